@@ -0,0 +1,472 @@
+/* bench.c, timing harness for the zepl hot paths, Public Domain */
+
+/*
+ * Built by "make bench" and linked against a copy of zepl.o whose main()
+ * has been renamed, so the real editor code is what gets timed.  Each
+ * result is written to stdout as one line of JSON, so runs from
+ * different builds can be compared with ordinary tools.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <curses.h>
+
+typedef unsigned char char_t;
+typedef long point_t;
+typedef struct buffer_t buffer_t;
+
+extern buffer_t *new_buffer(void);
+extern point_t document_size(buffer_t *);
+extern int insert_text(buffer_t *, point_t, char_t *, point_t);
+extern int delete_text(buffer_t *, point_t, point_t);
+extern point_t movegap(buffer_t *, point_t);
+extern int growgap(buffer_t *, point_t);
+extern void shrinkgap(buffer_t *, point_t);
+extern void insert_string(char *);
+extern point_t upup(buffer_t *, point_t);
+extern point_t dndn(buffer_t *, point_t);
+extern point_t lncolumn(buffer_t *, point_t, int);
+extern point_t search_forward(buffer_t *, point_t, char *);
+extern point_t re_search_curbp(point_t, char *, int, char **);
+extern buffer_t *curbp;
+extern point_t occur(buffer_t *, char *, point_t **);
+extern int undo_buffer(buffer_t *, int);
+extern void display(void);
+extern void redraw(void);
+extern void set_point(point_t);
+extern unsigned long undo_seq;
+extern void setup_keys(void);
+extern int init_lisp(void);
+extern char *call_lisp(char *);
+extern int compile_lisp(char *);
+extern char *run_lisp(int);
+extern void reset_output_stream(void);
+extern char *load_file(int);
+extern void set_macro(char *);
+extern void call_macro(void);
+extern void execute_key(void *, char_t *);
+extern void lnbegin(void);
+extern void down(void);
+extern void *key_match(buffer_t *, char_t *, int, int *);
+
+#define BENCH_SIZE      (100L*1024*1024)
+#define BENCH_EDITS     1000
+#define BENCH_PASTE     (1024L*1024)
+#define BENCH_PASTES    50
+#define BENCH_LONGLINE  20000
+#define BENCH_SCROLL    20000
+#define BENCH_HUGELINE  (10L*1024*1024)
+#define BENCH_UNDO      10000
+#define BENCH_FRAMES    2000
+#define BENCH_ROWS      60
+#define BENCH_COLS      250
+#define BENCH_KEYS      1000000
+#define BENCH_LISPKEYS  200000
+#define BENCH_MACRO     5000
+#define BENCH_TYPED     (100L*1024)
+#define BENCH_MOVES     1000
+#define BENCH_GROWS     100
+#define BENCH_STRINGS   100000
+#define BENCH_LOADS     20
+#define BENCH_FIBS      5
+
+static unsigned long seed = 1;
+
+/* small deterministic generator so every build sees the same workload */
+point_t rnd(point_t n)
+{
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (n <= 0 ? 0 : (point_t) ((seed >> 33) % (unsigned long) n));
+}
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+void report(char *name, point_t size, long ops, double secs)
+{
+	printf("{\"bench\":\"%s\",\"size\":%ld,\"ops\":%ld,\"secs\":%.6f,\"ops_per_sec\":%.1f}\n",
+		name, size, ops, secs, secs > 0 ? ops / secs : 0.0);
+	fflush(stdout);
+}
+
+/* a buffer holding size chars of text, built up a line of len chars at a time, a tab every tab chars if tab is not 0 */
+buffer_t *make_text(point_t size, int len, int tab)
+{
+	buffer_t *bp = new_buffer();
+	char_t *line = malloc(len);
+	int i;
+
+	for (i = 0; i < len - 1; i++)
+		line[i] = (tab != 0 && i % tab == tab - 1 ? '\t' : 'a' + i % 26);
+	line[len - 1] = '\n';
+	while (document_size(bp) < size)
+		insert_text(bp, document_size(bp), line, len);
+	free(line);
+	return (bp);
+}
+
+buffer_t *make_lines(point_t size, int len) { return make_text(size, len, 50); }
+buffer_t *make_buffer(point_t size) { return make_lines(size, 80); }
+
+void bench_gap()
+{
+	buffer_t *bp;
+	char_t *paste;
+	char *err;
+	double t, secs;
+	long i;
+
+	t = now();
+	bp = make_buffer(BENCH_SIZE);
+	report("gap_build", BENCH_SIZE, BENCH_SIZE / 80, now() - t);
+
+	t = now();
+	for (i = 0; i < 5; i++)
+		(void) search_forward(bp, 0, "not in the buffer");
+	report("search_forward_miss", document_size(bp), 5, now() - t);
+
+	curbp = bp;
+	t = now();
+	for (i = 0; i < 5; i++)
+		(void) re_search_curbp(0, "not (in|at) the buf+er", 0, &err);
+	report("re_search_forward_miss", document_size(bp), 5, now() - t);
+
+	t = now();
+	for (i = 0; i < 5; i++)
+		(void) occur(bp, "xyz", NULL);
+	report("occur_count", document_size(bp), 5, now() - t);
+
+	t = now();
+	for (i = 0; i < BENCH_EDITS; i++)
+		insert_text(bp, rnd(document_size(bp)), (char_t *) "x", 1);
+	report("gap_random_insert", document_size(bp), BENCH_EDITS, now() - t);
+
+	t = now();
+	for (i = 0; i < BENCH_EDITS; i++)
+		delete_text(bp, rnd(document_size(bp)), 1);
+	report("gap_random_delete", document_size(bp), BENCH_EDITS, now() - t);
+
+	t = now();
+	for (i = 0; i < BENCH_EDITS; i++)
+		insert_text(bp, (i & 1) ? document_size(bp) : 0, (char_t *) "x", 1);
+	report("gap_top_bottom_insert", document_size(bp), BENCH_EDITS, now() - t);
+
+	paste = malloc(BENCH_PASTE);
+	memset(paste, 'p', BENCH_PASTE);
+	t = now();
+	for (i = 0; i < BENCH_PASTES; i++)
+		insert_text(bp, rnd(document_size(bp)), paste, BENCH_PASTE);
+	report("gap_random_paste_1mb", document_size(bp), BENCH_PASTES, now() - t);
+
+	t = now();
+	for (i = 0; i < BENCH_PASTES; i++)
+		delete_text(bp, rnd(document_size(bp) - BENCH_PASTE), BENCH_PASTE);
+	report("gap_random_cut_1mb", document_size(bp), BENCH_PASTES, now() - t);
+	free(paste);
+
+	t = now();
+	for (i = 0; i < BENCH_MOVES; i++)
+		(void) movegap(bp, rnd(document_size(bp)));
+	report("gap_movegap", document_size(bp), BENCH_MOVES, now() - t);
+
+	/* give each grow back, untimed, or the buffer would end up hundreds of MB bigger */
+	for (i = 0, secs = 0; i < BENCH_GROWS; i++) {
+		t = now();
+		(void) growgap(bp, BENCH_PASTE);
+		secs += now() - t;
+		shrinkgap(bp, BENCH_PASTE);
+	}
+	report("gap_growgap_1mb", document_size(bp), BENCH_GROWS, secs);
+
+	curbp = bp;
+	t = now();
+	for (i = 0; i < BENCH_STRINGS; i++)
+		insert_string("insert_string\n");
+	report("insert_string", document_size(bp), BENCH_STRINGS, now() - t);
+}
+
+/* a script of small edits to a config sized file, undone and redone as one command */
+void bench_undo()
+{
+	buffer_t *bp = make_buffer(1024L*1024);
+	double t;
+	long i;
+
+	undo_seq++;
+	t = now();
+	for (i = 0; i < BENCH_UNDO; i++) {
+		if (i & 1)
+			delete_text(bp, rnd(document_size(bp)), 1);
+		else
+			insert_text(bp, rnd(document_size(bp)), (char_t *) "x", 1);
+	}
+	report("undo_record_edits", document_size(bp), BENCH_UNDO, now() - t);
+
+	t = now();
+	(void) undo_buffer(bp, 0);
+	report("undo_script", document_size(bp), BENCH_UNDO, now() - t);
+
+	t = now();
+	(void) undo_buffer(bp, 1);
+	report("redo_script", document_size(bp), BENCH_UNDO, now() - t);
+}
+
+/* screen line motion through long lines, as when scrolling */
+void bench_scroll()
+{
+	buffer_t *bp = make_lines(BENCH_SIZE / 10, BENCH_LONGLINE);
+	point_t off = 0, size;
+	char name[40];
+	double t;
+	long i;
+
+	COLS = 80;
+	t = now();
+	for (i = 0; i < BENCH_SCROLL; i++)
+		off = lncolumn(bp, dndn(bp, off), 0);
+	report("scroll_down_long_lines", document_size(bp), BENCH_SCROLL, now() - t);
+
+	t = now();
+	for (i = 0; i < BENCH_SCROLL; i++)
+		off = lncolumn(bp, upup(bp, off), 0);
+	report("scroll_up_long_lines", document_size(bp), BENCH_SCROLL, now() - t);
+
+	/* and about the middle of a single line of 10MB */
+	bp = make_lines(BENCH_HUGELINE, BENCH_HUGELINE);
+	off = BENCH_HUGELINE / 2;
+	t = now();
+	for (i = 0; i < BENCH_SCROLL; i++)
+		off = (i & 1024) ? upup(bp, off) : dndn(bp, off);
+	report("scroll_huge_line", document_size(bp), BENCH_SCROLL, now() - t);
+
+	/* minified JSON or JS has no tabs at all, the time should not grow with the line */
+	for (size = BENCH_HUGELINE; size <= 4 * BENCH_HUGELINE; size *= 4) {
+		bp = make_text(size, size, 0);
+		/* the first move finds the screen lines up to it, time the rest */
+		off = dndn(bp, size / 2);
+		t = now();
+		for (i = 0; i < BENCH_SCROLL; i++)
+			off = lncolumn(bp, (i & 1024) ? upup(bp, off) : dndn(bp, off), 40);
+		snprintf(name, sizeof (name), "scroll_plain_line_%ldmb", size >> 20);
+		report(name, document_size(bp), BENCH_SCROLL, now() - t);
+	}
+}
+
+/* frames painted on a wide terminal, all of each and then only what the cursor moves */
+void bench_display()
+{
+	SCREEN *scr;
+	FILE *out;
+	double t;
+	long i;
+
+	if ((out = fopen("/dev/null", "w")) == NULL || (scr = newterm("xterm", out, stdin)) == NULL)
+		return;
+	resizeterm(BENCH_ROWS, BENCH_COLS);
+	curbp = make_lines(BENCH_SIZE / 10, 300);
+	display();
+
+	t = now();
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		redraw();
+		display();
+	}
+	report("display_full_fps", document_size(curbp), BENCH_FRAMES, now() - t);
+
+	t = now();
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		set_point(i % (BENCH_COLS * 10));
+		display();
+	}
+	report("display_cursor_fps", document_size(curbp), BENCH_FRAMES, now() - t);
+
+	t = now();
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		insert_string("x");
+		display();
+	}
+	report("display_typing_fps", document_size(curbp), BENCH_FRAMES, now() - t);
+
+	endwin();
+	delscreen(scr);
+	fclose(out);
+}
+
+/* key sequences looked up as each of their bytes arrives */
+void bench_keys()
+{
+	static char *seq[] = { "\x01", "\x18\x13", "\x1B\x5B\x41", "\x1B\x5B\x36\x7E", "x" };
+	char_t *s;
+	int more, n;
+	double t;
+	long i;
+
+	t = now();
+	for (i = 0; i < BENCH_KEYS; i++) {
+		s = (char_t *) seq[i % 5];
+		n = 0;
+		do
+			(void) key_match(NULL, s, ++n, &more);
+		while (more);
+	}
+	report("key_dispatch", 0, BENCH_KEYS, now() - t);
+}
+
+/* a key bound to a Lisp function, read for every press as before and read once */
+void bench_lisp_keys()
+{
+	double t;
+	long i;
+	int id;
+
+	reset_output_stream();
+	(void) call_lisp("(defun bench-key () (if (= 1 1) (setq bench-n (+ 1 2))))");
+
+	t = now();
+	for (i = 0; i < BENCH_LISPKEYS; i++) {
+		reset_output_stream();
+		(void) call_lisp("(bench-key)");
+	}
+	report("lisp_key_reparse", 0, BENCH_LISPKEYS, now() - t);
+
+	reset_output_stream();
+	id = compile_lisp("(bench-key)");
+	t = now();
+	for (i = 0; i < BENCH_LISPKEYS; i++)
+		(void) run_lisp(id);
+	report("lisp_key_cached", 0, BENCH_LISPKEYS, now() - t);
+}
+
+/* a keyboard macro of three commands run on each of BENCH_MACRO lines, against the same keys painted one by one */
+void bench_macro()
+{
+	SCREEN *scr;
+	FILE *out;
+	char *text;
+	double t;
+	long i;
+
+	if ((out = fopen("/dev/null", "w")) == NULL || (scr = newterm("xterm", out, stdin)) == NULL)
+		return;
+	resizeterm(BENCH_ROWS, BENCH_COLS);
+	curbp = make_lines(BENCH_MACRO * 2 * 40, 40);
+	set_macro("\x01x\x0e");
+	display();
+
+	t = now();
+	for (i = 0; i < BENCH_MACRO; i++)
+		call_macro();
+	display();
+	report("macro_replay", document_size(curbp), 3 * BENCH_MACRO, now() - t);
+
+	t = now();
+	for (i = 0; i < BENCH_MACRO; i++) {
+		lnbegin();
+		display();
+		execute_key(NULL, (char_t *) "x");
+		display();
+		down();
+		display();
+	}
+	report("keys_painted", document_size(curbp), 3 * BENCH_MACRO, now() - t);
+
+	/* 100KB of text arriving as keys all at once, bare and as a bracketed paste */
+	text = malloc(BENCH_TYPED + 16);
+	for (i = 0; i < BENCH_TYPED; i++)
+		text[i] = (i % 60 == 59 ? '\n' : 'a' + i % 26);
+	text[BENCH_TYPED] = '\0';
+	set_macro(text);
+	t = now();
+	call_macro();
+	display();
+	report("typeahead_100kb", document_size(curbp), 1, now() - t);
+
+	memmove(text + 6, text, BENCH_TYPED);
+	memcpy(text, "\x1B[200~", 6);
+	strcpy(text + 6 + BENCH_TYPED, "\x1B[201~");
+	set_macro(text);
+	t = now();
+	call_macro();
+	display();
+	report("paste_100kb", document_size(curbp), 1, now() - t);
+	free(text);
+
+	endwin();
+	delscreen(scr);
+	fclose(out);
+}
+
+/* the time to read a file of Lisp, or -1 if it could not be opened */
+double load_lisp(char *fname)
+{
+	double t = now();
+	int fd;
+
+	if ((fd = open(fname, O_RDONLY)) == -1)
+		return (-1);
+	reset_output_stream();
+	(void) load_file(fd);
+	close(fd);
+	return (now() - t);
+}
+
+/* the interpreter on zepl.rc, and on the functions of examples/fib.lsp, run from the source directory */
+void bench_lisp()
+{
+	double t, secs = 0;
+	long i;
+
+	for (i = 0; i < BENCH_LOADS && 0 <= secs; i++)
+		secs = (0 <= (t = load_lisp("zepl.rc")) ? secs + t : -1);
+	if (0 <= secs)
+		report("lisp_load_zepl_rc", 0, BENCH_LOADS, secs);
+
+	/* the file stops reading at its first printed result, after fib is defined */
+	if (load_lisp("examples/fib.lsp") < 0)
+		return;
+	reset_output_stream();
+	t = now();
+	for (i = 0; i < BENCH_FIBS; i++)
+		(void) call_lisp("(fib 20)");
+	report("lisp_fib_20", 0, BENCH_FIBS, now() - t);
+	reset_output_stream();
+}
+
+struct {
+	char *name;
+	void (*func)(void);
+} benches[] = {
+	{ "gap", bench_gap },
+	{ "undo", bench_undo },
+	{ "scroll", bench_scroll },
+	{ "display", bench_display },
+	{ "keys", bench_keys },
+	{ "lisp_keys", bench_lisp_keys },
+	{ "macro", bench_macro },
+	/* last, as zepl.rc binds keys of its own */
+	{ "lisp", bench_lisp },
+};
+
+/* zepl-bench [name...] runs the named groups of benches, or all of them */
+int main(int argc, char **argv)
+{
+	int i, j;
+
+	setup_keys();
+	(void) init_lisp();
+	for (i = 0; i < (int) (sizeof (benches) / sizeof (benches[0])); i++) {
+		for (j = 1; j < argc && strcmp(argv[j], benches[i].name) != 0; j++)
+			;
+		if (argc == 1 || j < argc)
+			(benches[i].func)();
+	}
+	return 0;
+}
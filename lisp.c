@@ -8,6 +8,8 @@
  *  int init_lisp()
  *  char *call_lisp(char *input)
  *  char *load_file(charint infd, char *output, int o_size)
+ *  int compile_lisp(char *input)
+ *  char *run_lisp(int id)
  *
  * Input and Output is a Stream abstraction layer.
  * There is 1 and only 1 output stream which is only cleared
@@ -72,6 +74,17 @@ struct Object {
 };
 
 static Object *symbols = NULL;
+
+/* forms read once and kept, as for key bindings, rooted by gc() like symbols */
+typedef struct Form {
+	Object *source;           /* the form as read, NULL when the slot is free */
+	Object *call;             /* source with its function looked up, nil until then */
+	unsigned long defs;       /* lispDefs when call was made */
+} Form;
+
+static Form *forms = NULL;
+static int nForms = 0, maxForms = 0;
+static unsigned long lispDefs = 0;  /* global functions (re)defined */
 static Object *nil = &(Object) { TYPE_SYMBOL,.string = "nil" };
 static Object *t = &(Object) { TYPE_SYMBOL,.string = "t" };
 
@@ -100,6 +113,13 @@ static Memory *memory = &(Memory) { MEMORY_SIZE };
 
 static jmp_buf exceptionEnv;
 
+/*
+ * The GC roots the entry points below start from.  A primitive that runs
+ * Lisp again, through load_file() or a key, sets them to its own, so a
+ * collection inside traces the evaluation it was called from too.
+ */
+static Object *lispRoots;
+
 // EXCEPTION HANDLING /////////////////////////////////////////////////////////
 
 #define exception(...)       exceptionWithObject(NULL, __VA_ARGS__)
@@ -286,6 +306,10 @@ void gc(GC_PARAM)
 
 	// move symbols and root objects
 	symbols = gcMoveObject(symbols);
+	for (int i = 0; i < nForms; i++) {
+		forms[i].source = gcMoveObject(forms[i].source);
+		forms[i].call = gcMoveObject(forms[i].call);
+	}
 
 	for (Object * object = GC_ROOTS; object != nil; object = object->cdr)
 		object->car = gcMoveObject(object->car);
@@ -901,8 +925,21 @@ Object *envLookup(Object * var, Object * env)
 	exceptionWithObject(var, "has no value");
 }
 
+bool isCallable(Object * object)
+{
+	return object->type == TYPE_LAMBDA || object->type == TYPE_MACRO || object->type == TYPE_PRIMITIVE;
+}
+
+/* a global function being set makes the functions looked up for forms stale */
+void noteDefinition(Object * env, Object * old, Object * new)
+{
+	if (env->parent == nil && (isCallable(new) || (old != NULL && isCallable(old))))
+		lispDefs++;
+}
+
 Object *envAdd(Object ** var, Object ** val, Object ** env, GC_PARAM)
 {
+	noteDefinition(*env, NULL, *val);
 	GC_TRACE(gcVars, newCons(var, &nil, GC_ROOTS));
 	GC_TRACE(gcVals, newCons(val, &nil, GC_ROOTS));
 
@@ -920,10 +957,14 @@ Object *envSet(Object ** var, Object ** val, Object ** env, GC_PARAM)
 		Object *vars = (*gcEnv)->vars, *vals = (*gcEnv)->vals;
 
 		for (; vars->type == TYPE_CONS; vars = vars->cdr, vals = vals->cdr) {
-			if (vars->car == *var)
+			if (vars->car == *var) {
+				noteDefinition(*gcEnv, vals->car, *val);
 				return vals->car = *val;
-			if (vars->cdr == *var)
+			}
+			if (vars->cdr == *var) {
+				noteDefinition(*gcEnv, vals->cdr, *val);
 				return vals->cdr = *val;
+			}
 		}
 
 		if ((*gcEnv)->parent == nil)
@@ -1017,7 +1058,9 @@ DEFINE_EDITOR_FUNC(down)
 DEFINE_EDITOR_FUNC(lnbegin)
 DEFINE_EDITOR_FUNC(lnend)
 DEFINE_EDITOR_FUNC(yank)
+DEFINE_EDITOR_FUNC(yank_pop)
 DEFINE_EDITOR_FUNC(display)
+DEFINE_EDITOR_FUNC(redraw)
 DEFINE_EDITOR_FUNC(copy_region)
 DEFINE_EDITOR_FUNC(set_mark)
 DEFINE_EDITOR_FUNC(kill_region)
@@ -1028,9 +1071,34 @@ DEFINE_EDITOR_FUNC(pgup)
 DEFINE_EDITOR_FUNC(save_buffer)
 DEFINE_EDITOR_FUNC(quit)
 DEFINE_EDITOR_FUNC(eval_block)
+DEFINE_EDITOR_FUNC(undo)
+DEFINE_EDITOR_FUNC(redo)
+DEFINE_EDITOR_FUNC(recover_file)
+DEFINE_EDITOR_FUNC(latency_reset)
+DEFINE_EDITOR_FUNC(start_macro)
+DEFINE_EDITOR_FUNC(end_macro)
+
+extern void call_macro();
+
+/* the keys played may run Lisp of their own */
+Object *e_call_macro(Object ** args, GC_PARAM)
+{
+	Object *outer = lispRoots;
+
+	lispRoots = GC_ROOTS;
+	call_macro();
+	lispRoots = outer;
+	return t;
+}
 
 
 extern int set_key(char *, char *);
+extern int hold_display;
+extern int get_byte(void);
+extern void set_macro(char *);
+extern int set_mode_key(char *, char *, char *);
+extern int set_mode(char *);
+extern char *get_mode(void);
 extern char *get_char(void);
 extern char *get_input_key(void);
 extern char *get_key_name(void);
@@ -1060,7 +1128,8 @@ Object *e_get_key_funcname(Object **args, GC_PARAM) { return newString(get_key_f
 
 Object *e_refresh(Object ** args, GC_PARAM)
 {
-	refresh();
+	if (!hold_display)
+		refresh();
 	return t;
 }
 
@@ -1070,6 +1139,23 @@ Object *e_set_key(Object ** args, GC_PARAM)
 	return (1 == set_key(first->string, second->string) ? t : nil);
 }
 
+Object *e_set_mode_key(Object ** args, GC_PARAM)
+{
+	Object *third = (*args)->cdr->cdr->car;
+	TWO_STRING_ARGS();
+	if (third->type != TYPE_STRING)
+	    exceptionWithObject(third, "is not a string");
+	return (1 == set_mode_key(first->string, second->string, third->string) ? t : nil);
+}
+
+Object *e_set_mode(Object ** args, GC_PARAM)
+{
+	ONE_STRING_ARG();
+	return (set_mode(first->string) ? t : nil);
+}
+
+Object *e_get_mode(Object ** args, GC_PARAM) { return newString(get_mode(), GC_ROOTS); }
+
 Object *stringAppend(Object ** args, GC_PARAM)
 {
 	TWO_STRING_ARGS();
@@ -1207,10 +1293,351 @@ Object *e_search_forward(Object ** args, GC_PARAM)
 	return newNumber(num, GC_ROOTS);
 }
 
+extern point_t search_backward_curbp(point_t, char *);
+extern point_t isearch_curbp(point_t, char *, int);
+
+Object *e_search_backward(Object ** args, GC_PARAM)
+{
+	Object *first = (*args)->car;
+	Object *second = (*args)->cdr->car;
+
+	if (first->type != TYPE_NUMBER)
+	    exceptionWithObject(first, "is not a number");
+	if (second->type != TYPE_STRING)
+	    exceptionWithObject(second, "is not a string");
+
+	double num = search_backward_curbp((point_t)first->number, second->string);
+	return newNumber(num, GC_ROOTS);
+}
+
+Object *isearch_dir(Object ** args, int backward, GC_PARAM)
+{
+	Object *first = (*args)->car;
+	Object *second = (*args)->cdr->car;
+
+	if (first->type != TYPE_NUMBER)
+	    exceptionWithObject(first, "is not a number");
+	if (second->type != TYPE_STRING)
+	    exceptionWithObject(second, "is not a string");
+
+	double num = isearch_curbp((point_t)first->number, second->string, backward);
+	return newNumber(num, GC_ROOTS);
+}
+
+Object *e_isearch_forward(Object ** args, GC_PARAM) { return isearch_dir(args, 0, GC_ROOTS); }
+Object *e_isearch_backward(Object ** args, GC_PARAM) { return isearch_dir(args, 1, GC_ROOTS); }
+
+extern point_t count_matches_curbp(char *);
+extern point_t *occur_offsets_curbp(char *, point_t *);
+extern char *occur_curbp(char *, point_t *);
+
+Object *e_count_matches(Object ** args, GC_PARAM)
+{
+	ONE_STRING_ARG();
+	return newNumber(count_matches_curbp(first->string), GC_ROOTS);
+}
+
+Object *e_occur_offsets(Object ** args, GC_PARAM)
+{
+	Object *first = (*args)->car;
+	point_t *offs, n, i;
+
+	if (first->type != TYPE_STRING)
+	    exceptionWithObject(first, "is not a string");
+	if (((*args)->cdr) != nil && (*args)->cdr->car->type != TYPE_NUMBER)
+	    exceptionWithObject((*args)->cdr->car, "is not a number");
+
+	if ((offs = occur_offsets_curbp(first->string, &n)) == NULL && n < 0)
+	    exception("out of memory");
+	if ((*args)->cdr != nil && (*args)->cdr->car->number < n)
+		n = (point_t) (*args)->cdr->car->number;
+
+	GC_TRACE(gcList, nil);
+	GC_TRACE(gcNum, nil);
+	for (i = n - 1; 0 <= i; i--) {
+		*gcNum = newNumber(offs[i], GC_ROOTS);
+		*gcList = newCons(gcNum, gcList, GC_ROOTS);
+	}
+	free(offs);
+	return *gcList;
+}
+
+Object *e_occur(Object ** args, GC_PARAM)
+{
+	point_t count;
+	char *s;
+
+	ONE_STRING_ARG();
+	if ((s = occur_curbp(first->string, &count)) == NULL)
+	    exception("out of memory");
+
+	/* buffer text is copied as is, it has no escapes to process */
+	Object *obj = newObjectWithString(TYPE_STRING, strlen(s) + 1, GC_ROOTS);
+	strcpy(obj->string, s);
+	free(s);
+	return obj;
+}
+
+extern point_t re_search_curbp(point_t, char *, int, char **);
+extern point_t match_pos(int, int);
+extern char *match_string(int, point_t *);
+
+Object *re_search(Object ** args, int backward, GC_PARAM)
+{
+	Object *first = (*args)->car;
+	Object *second = (*args)->cdr->car;
+	char *err;
+
+	if (first->type != TYPE_NUMBER)
+	    exceptionWithObject(first, "is not a number");
+	if (second->type != TYPE_STRING)
+	    exceptionWithObject(second, "is not a string");
+
+	double num = re_search_curbp((point_t)first->number, second->string, backward, &err);
+	if (err != NULL)
+	    exceptionWithObject(second, "is not a valid regular expression, %s", err);
+	return newNumber(num, GC_ROOTS);
+}
+
+Object *e_re_search_forward(Object ** args, GC_PARAM) { return re_search(args, 0, GC_ROOTS); }
+Object *e_re_search_backward(Object ** args, GC_PARAM) { return re_search(args, 1, GC_ROOTS); }
+
+Object *match_group(Object ** args, int end, GC_PARAM)
+{
+	int n = 0;
+
+	if (*args != nil) {
+		Object *first = (*args)->car;
+		if (first->type != TYPE_NUMBER)
+		    exceptionWithObject(first, "is not a number");
+		n = (int)first->number;
+	}
+	return newNumber(match_pos(n, end), GC_ROOTS);
+}
+
+Object *e_match_beginning(Object ** args, GC_PARAM) { return match_group(args, 0, GC_ROOTS); }
+Object *e_match_end(Object ** args, GC_PARAM) { return match_group(args, 1, GC_ROOTS); }
+
+Object *e_match_string(Object ** args, GC_PARAM)
+{
+	point_t len;
+	int n = 0;
+	char *s;
+
+	if (*args != nil) {
+		Object *first = (*args)->car;
+		if (first->type != TYPE_NUMBER)
+		    exceptionWithObject(first, "is not a number");
+		n = (int)first->number;
+	}
+	if ((s = match_string(n, &len)) == NULL) return nil;
+
+	/* buffer text is copied as is, it has no escapes to process */
+	Object *obj = newObjectWithString(TYPE_STRING, len + 1, GC_ROOTS);
+	memcpy(obj->string, s, len + 1);
+	free(s);
+	return obj;
+}
+
+extern char *buffer_name_curbp(void);
+extern char *buffer_name_nth(int);
+extern void switch_to_buffer(char *);
+extern void find_file(char *);
+extern void next_buffer(void);
+extern int kill_buffer(char *, int);
+extern int buffer_modified(char *);
+
+Object *e_buffer_name(Object ** args, GC_PARAM) { return newString(buffer_name_curbp(), GC_ROOTS); }
+Object *e_next_buffer(Object ** args, GC_PARAM) { next_buffer(); return t; }
+
+Object *e_buffer_list(Object ** args, GC_PARAM)
+{
+	int n;
+
+	GC_TRACE(gcList, nil);
+	GC_TRACE(gcName, nil);
+	for (n = 0; buffer_name_nth(n) != NULL; n++)
+		;
+	while (0 < n--) {
+		*gcName = newString(buffer_name_nth(n), GC_ROOTS);
+		*gcList = newCons(gcName, gcList, GC_ROOTS);
+	}
+	return *gcList;
+}
+
+Object *e_switch_to_buffer(Object ** args, GC_PARAM)
+{
+	ONE_STRING_ARG();
+	switch_to_buffer(first->string);
+	return t;
+}
+
+Object *e_find_file(Object ** args, GC_PARAM)
+{
+	ONE_STRING_ARG();
+	find_file(first->string);
+	return t;
+}
+
+/* the buffer named by an optional first argument, NULL for the current one */
+char *buffer_arg(Object ** args)
+{
+	Object *first;
+
+	if (*args == nil || (first = (*args)->car) == nil) return (NULL);
+	if (first->type != TYPE_STRING)
+	    exceptionWithObject(first, "is not a string");
+	return (first->string);
+}
+
+Object *e_buffer_modified_p(Object ** args, GC_PARAM) { return (buffer_modified(buffer_arg(args)) ? t : nil); }
+
+Object *e_kill_buffer(Object ** args, GC_PARAM)
+{
+	char *name = buffer_arg(args);
+	int force = (*args != nil && (*args)->cdr != nil && (*args)->cdr->car != nil);
+
+	return (kill_buffer(name, force) ? t : nil);
+}
+
+extern void goto_line(point_t);
+extern point_t get_line_number(point_t);
+
+extern char *current_kill(int, point_t *);
+extern int kill_new(char *, point_t);
+extern point_t kill_ring_budget(point_t);
+extern point_t gap_growth_cap(point_t);
+
+Object *e_current_kill(Object ** args, GC_PARAM)
+{
+	point_t len;
+	char *s;
+	int n = 0;
+
+	if (*args != nil) {
+		Object *first = (*args)->car;
+		if (first->type != TYPE_NUMBER)
+		    exceptionWithObject(first, "is not a number");
+		n = (int)first->number;
+	}
+	if ((s = current_kill(n, &len)) == NULL) return nil;
+
+	/* killed text is copied as is, it has no escapes to process */
+	Object *obj = newObjectWithString(TYPE_STRING, len + 1, GC_ROOTS);
+	memcpy(obj->string, s, len + 1);
+	return obj;
+}
+
+Object *e_kill_new(Object ** args, GC_PARAM)
+{
+	ONE_STRING_ARG();
+	return (kill_new(first->string, strlen(first->string)) ? t : nil);
+}
+
+Object *e_kill_ring_budget(Object ** args, GC_PARAM)
+{
+	point_t n = -1;
+
+	if (*args != nil) {
+		Object *first = (*args)->car;
+		if (first->type != TYPE_NUMBER)
+		    exceptionWithObject(first, "is not a number");
+		n = (point_t)first->number;
+	}
+	return newNumber(kill_ring_budget(n), GC_ROOTS);
+}
+
+Object *e_gap_growth_cap(Object ** args, GC_PARAM)
+{
+	point_t n = -1;
+
+	if (*args != nil) {
+		Object *first = (*args)->car;
+		if (first->type != TYPE_NUMBER)
+		    exceptionWithObject(first, "is not a number");
+		n = (point_t)first->number;
+	}
+	return newNumber(gap_growth_cap(n), GC_ROOTS);
+}
+
+extern int latency(char *, long *);
+extern char *slowest_command(long *);
+extern void set_show_latency(int);
+
+/* (count p50 p90 p99 max) in microseconds, over the last keys */
+Object *e_latency(Object ** args, GC_PARAM)
+{
+	long stats[5];
+	int i;
+
+	ONE_STRING_ARG();
+	if (!latency(first->string, stats))
+	    exceptionWithObject(first, "is not read, run or paint");
+
+	GC_TRACE(gcList, nil);
+	GC_TRACE(gcNum, nil);
+	for (i = 4; 0 <= i; i--) {
+		*gcNum = newNumber(stats[i], GC_ROOTS);
+		*gcList = newCons(gcNum, gcList, GC_ROOTS);
+	}
+	return *gcList;
+}
+
+/* ("(command)" microseconds), or nil if nothing has run */
+Object *e_slowest_command(Object ** args, GC_PARAM)
+{
+	char *fn;
+	long us;
+
+	if ((fn = slowest_command(&us)) == NULL) return nil;
+	GC_TRACE(gcList, nil);
+	GC_TRACE(gcItem, newNumber(us, GC_ROOTS));
+	*gcList = newCons(gcItem, gcList, GC_ROOTS);
+	*gcItem = newObjectWithString(TYPE_STRING, strlen(fn) + 1, GC_ROOTS);
+	strcpy((*gcItem)->string, fn);
+	*gcList = newCons(gcItem, gcList, GC_ROOTS);
+	return *gcList;
+}
+
+Object *e_show_latency(Object ** args, GC_PARAM)
+{
+	set_show_latency((*args)->car != nil);
+	return t;
+}
+
+Object *e_goto_line(Object ** args, GC_PARAM)
+{
+	Object *first = (*args)->car;
+	if (first->type != TYPE_NUMBER)
+	    exceptionWithObject(first, "is not a number");
+	goto_line((point_t)first->number);
+	return t;
+}
+
+Object *e_line_number_at_pos(Object ** args, GC_PARAM)
+{
+	point_t p = -1;
+
+	if (*args != nil) {
+		Object *first = (*args)->car;
+		if (first->type != TYPE_NUMBER)
+		    exceptionWithObject(first, "is not a number");
+		p = (point_t)first->number;
+	}
+	return newNumber(get_line_number(p), GC_ROOTS);
+}
+
+Object *e_set_macro(Object ** args, GC_PARAM)
+{
+	ONE_STRING_ARG();
+	set_macro(first->string);
+	return t;
+}
+
 Object *e_getch(Object ** args, GC_PARAM)
 {
 	char ch[2];
-	ch[0] = (unsigned char)getch();
+	ch[0] = (unsigned char)get_byte();
 	ch[1] = '\0';
 	return newStringWithLength(ch, 1, GC_ROOTS);
 }
@@ -1260,7 +1687,11 @@ Object *e_load(Object ** args, GC_PARAM)
 		return nil;
 	}
 
+	Object *outer = lispRoots;
+
+	lispRoots = GC_ROOTS;
 	char *out = load_file(fd);
+	lispRoots = outer;
 	close(fd);
 	return (NULL == strstr(out, "error:")) ? t : nil;
 }
@@ -1400,6 +1831,9 @@ Primitive primitives[] = {
 	{"set-point", 1, 1, e_set_point},
 	{"get-point", 0, 0, e_get_point},
 	{"set-key", 2, 2, e_set_key},
+	{"set-mode-key", 3, 3, e_set_mode_key},
+	{"set-mode", 1, 1, e_set_mode},
+	{"mode", 0, 0, e_get_mode},
 	{"prompt", 2, 2, e_prompt},
 	{"eval-block", 0, 0, e_eval_block},
 	{"get-char", 0, 0, e_get_char},
@@ -1408,8 +1842,37 @@ Primitive primitives[] = {
 	{"get-key-funcname", 0, 0, e_get_key_funcname},
 	{"getch", 0, 0, e_getch},
 	{"search-forward", 2, 2, e_search_forward},
+	{"search-backward", 2, 2, e_search_backward},
+	{"isearch-forward", 2, 2, e_isearch_forward},
+	{"isearch-backward", 2, 2, e_isearch_backward},
+	{"count-matches", 1, 1, e_count_matches},
+	{"occur-offsets", 1, 2, e_occur_offsets},
+	{"occur", 1, 1, e_occur},
+	{"re-search-forward", 2, 2, e_re_search_forward},
+	{"re-search-backward", 2, 2, e_re_search_backward},
+	{"match-beginning", 0, 1, e_match_beginning},
+	{"match-end", 0, 1, e_match_end},
+	{"match-string", 0, 1, e_match_string},
+	{"goto-line", 1, 1, e_goto_line},
+	{"line-number-at-pos", 0, 1, e_line_number_at_pos},
+	{"buffer-name", 0, 0, e_buffer_name},
+	{"buffer-list", 0, 0, e_buffer_list},
+	{"switch-to-buffer", 1, 1, e_switch_to_buffer},
+	{"find-file", 1, 1, e_find_file},
+	{"kill-buffer", 0, 2, e_kill_buffer},
+	{"buffer-modified-p", 0, 1, e_buffer_modified_p},
+	{"next-buffer", 0, 0, e_next_buffer},
 	{"display", 0, 0, e_display},
 	{"refresh", 0, 0, e_refresh},
+	{"redraw", 0, 0, e_redraw},
+	{"latency", 1, 1, e_latency},
+	{"slowest-command", 0, 0, e_slowest_command},
+	{"latency-reset", 0, 0, e_latency_reset},
+	{"start-kbd-macro", 0, 0, e_start_macro},
+	{"end-kbd-macro", 0, 0, e_end_macro},
+	{"call-last-kbd-macro", 0, 0, e_call_macro},
+	{"set-kbd-macro", 1, 1, e_set_macro},
+	{"show-latency", 1, 1, e_show_latency},
 
 	{"beginning-of-buffer", 0, 0, e_top},
 	{"end-of-buffer", 0, 0, e_bottom},
@@ -1424,10 +1887,18 @@ Primitive primitives[] = {
 	{"copy-region", 0, 0, e_copy_region},
 	{"kill-region", 0, 0, e_kill_region},
 	{"yank", 0, 0, e_yank},
+	{"yank-pop", 0, 0, e_yank_pop},
+	{"current-kill", 0, 1, e_current_kill},
+	{"kill-new", 1, 1, e_kill_new},
+	{"kill-ring-budget", 0, 1, e_kill_ring_budget},
+	{"gap-growth-cap", 0, 1, e_gap_growth_cap},
 	{"backspace", 0, 0, e_backspace},
+	{"undo", 0, 0, e_undo},
+	{"redo", 0, 0, e_redo},
 	{"page-down", 0, 0, e_pgdown},
 	{"page-up", 0, 0, e_pgup},
 	{"save-buffer", 0, 0, e_save_buffer},
+	{"recover-file", 0, 0, e_recover_file},
 	{"exit", 0, 0, e_quit}
 };
 
@@ -1815,6 +2286,65 @@ void call_lisp_body(Object ** env, GC_PARAM, Stream *input_stream)
 	}
 }
 
+int compile_lisp_body(Stream *input_stream, int id, GC_PARAM)
+{
+	GC_TRACE(gcObject, nil);
+	GC_TRACE(gcList, nil);
+	Object *prev, *next, *list;
+
+	if (setjmp(exceptionEnv)) {
+		forms[id].source = NULL;
+		return -1;
+	}
+
+	/* read every expression, newest first */
+	while (peekNext(input_stream) != EOF) {
+		*gcObject = readExpr(input_stream, GC_ROOTS);
+		*gcList = newCons(gcObject, gcList, GC_ROOTS);
+	}
+	/* then turn the list round in place, which allocates nothing */
+	for (prev = nil, list = *gcList; list != nil; prev = list, list = next) {
+		next = list->cdr;
+		list->cdr = prev;
+	}
+	*gcList = prev;
+
+	if (*gcList != nil && (*gcList)->cdr == nil) {
+		forms[id].source = (*gcList)->car;
+	} else {
+		*gcObject = newSymbol("progn", GC_ROOTS);
+		forms[id].source = newCons(gcObject, gcList, GC_ROOTS);
+	}
+	forms[id].call = nil;
+	return id;
+}
+
+char *run_lisp_body(int id, GC_PARAM)
+{
+	GC_TRACE(gcObject, nil);
+	GC_TRACE(gcFunc, nil);
+	GC_TRACE(gcArgs, nil);
+
+	if (setjmp(exceptionEnv))
+		return ostream.buffer;
+
+	/* look the function up once, until a global function is next set */
+	if (forms[id].call == nil || forms[id].defs != lispDefs) {
+		*gcObject = forms[id].source;
+		if ((*gcObject)->type == TYPE_CONS && (*gcObject)->car->type == TYPE_SYMBOL &&
+		    isCallable(*gcFunc = envLookup((*gcObject)->car, *theEnv))) {
+			*gcArgs = (*gcObject)->cdr;
+			forms[id].call = newCons(gcFunc, gcArgs, GC_ROOTS);
+		} else {
+			forms[id].call = forms[id].source;
+		}
+		forms[id].defs = lispDefs;
+	}
+	*gcObject = forms[id].call;
+	evalExpr(gcObject, theEnv, GC_ROOTS);
+	return NULL;
+}
+
 /*
  * 3 interface functions that enable lisp to be embedded in an application (eg Editor)
  */
@@ -1838,26 +2368,89 @@ int init_lisp()
 
 	theEnv = &temp_root.car;
 	theRoot = &temp_root;
+	lispRoots = theRoot;
 	return 0;
 }
 
+/*
+ * Each entry point may be called from inside another evaluation, so it
+ * puts back the exception handler of that one when done.
+ */
 char *call_lisp(char *input)
 {
 	assert(input != NULL);
 	Stream is = { .type = STREAM_TYPE_STRING };
+	jmp_buf outerEnv;
 
 	//debug("call_lisp()\n");
+	memcpy(outerEnv, exceptionEnv, sizeof (jmp_buf));
 	set_input_stream_buffer(&is, input);
-	call_lisp_body(theEnv, theRoot, &is);
+	call_lisp_body(theEnv, lispRoots, &is);
+	memcpy(exceptionEnv, outerEnv, sizeof (jmp_buf));
 	//debug("call_lisp() done\n");
 	return ostream.buffer;
 }
 
+/*
+ * Read input once and keep it, returning a number for run_lisp(), or -1 if
+ * it cannot be read.  Nothing is written to the output stream.
+ */
+int compile_lisp(char *input)
+{
+	Stream is = { .type = STREAM_TYPE_STRING };
+	jmp_buf outerEnv;
+	Form *f;
+	int id;
+
+	assert(input != NULL);
+	if (*input == '\0')
+		return -1;
+	for (id = 0; id < nForms && forms[id].source != NULL; id++)
+		;
+	if (id == maxForms) {
+		if ((f = realloc(forms, (maxForms + 32) * sizeof(Form))) == NULL)
+			return -1;
+		forms = f;
+		maxForms += 32;
+	}
+	if (id == nForms)
+		nForms++;
+	forms[id].source = forms[id].call = nil;
+	set_input_stream_buffer(&is, input);
+	memcpy(outerEnv, exceptionEnv, sizeof (jmp_buf));
+	id = compile_lisp_body(&is, id, lispRoots);
+	memcpy(exceptionEnv, outerEnv, sizeof (jmp_buf));
+	return id;
+}
+
+/* evaluate a form kept by compile_lisp(), returning NULL or the error written */
+char *run_lisp(int id)
+{
+	jmp_buf outerEnv;
+	char *output;
+
+	assert(0 <= id && id < nForms && forms[id].source != NULL);
+	memcpy(outerEnv, exceptionEnv, sizeof (jmp_buf));
+	output = run_lisp_body(id, lispRoots);
+	memcpy(exceptionEnv, outerEnv, sizeof (jmp_buf));
+	return output;
+}
+
+void forget_lisp(int id)
+{
+	if (0 <= id && id < nForms)
+		forms[id].source = NULL;
+}
+
 char *load_file(int infd)
 {
 	//debug("load_file fd=%d\n", infd);
 	Stream input_stream = { .type = STREAM_TYPE_FILE, .fd = -1 };
+	jmp_buf outerEnv;
+
+	memcpy(outerEnv, exceptionEnv, sizeof (jmp_buf));
 	set_stream_file(&input_stream, infd);
-	load_file_body(theEnv, theRoot, &input_stream);
+	load_file_body(theEnv, lispRoots, &input_stream);
+	memcpy(exceptionEnv, outerEnv, sizeof (jmp_buf));
 	return ostream.buffer;
 }
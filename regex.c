@@ -0,0 +1,836 @@
+/* regex.c, regular expression search for zepl, Public Domain */
+
+/*
+ * A pattern is parsed into a tree and compiled twice, forwards and
+ * reversed, into programs for a Thompson NFA.  Searching runs those
+ * programs as lazily built DFAs: a DFA state is the ordered list of NFA
+ * threads alive at that point, created the first time the text leads to
+ * it and cached with a 256 entry transition table, so each char costs a
+ * table lookup however complex the pattern.  The cache is flushed when it
+ * grows past RX_MAXSTATE states, which bounds memory at the cost of
+ * rebuilding states.
+ *
+ * A forward search runs the forward DFA from the start point to find
+ * where the leftmost match ends, then the reverse DFA back from there to
+ * find where it starts.  Only then is the NFA simulated directly (a Pike
+ * VM), over the match alone, to recover the groups.  A backward search
+ * runs the reverse DFA back from the start point to find the last place
+ * a match can start, and the Pike VM forwards from there.
+ *
+ * Syntax is egrep like: . [] [^] * + ? | () ^ $ and \ escapes, with
+ * \d \w \s and their upper case negations, and *? +? ?? for repeats
+ * that match as little as they can.  . does not match newline,
+ * ^ and $ match at the start and end of lines.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned char char_t;
+
+#define RX_NGROUP       10        /* groups, 0 being the whole match */
+#define RX_MAXINST      4000      /* largest program */
+#define RX_MAXSTATE     1000      /* DFA states cached before a flush */
+#define RX_HASH         1024
+
+/* provided by the editor, the text being searched */
+extern char_t *span_curbp(long, long *);
+extern char_t *rspan_curbp(long, long *);
+extern long size_curbp(void);
+
+enum { N_SET, N_CAT, N_ALT, N_STAR, N_PLUS, N_QUEST, N_GROUP, N_BOL, N_EOL, N_EMPTY };
+enum { I_SET, I_SPLIT, I_JMP, I_SAVE, I_BOL, I_EOL, I_MATCH };
+
+typedef struct node_t {
+	int n_type;
+	int n_val;                /* set index, group number, or TRUE if lazy */
+	struct node_t *n_left;
+	struct node_t *n_right;
+	struct node_t *n_next;    /* all nodes, for freeing */
+} node_t;
+
+typedef struct inst_t {
+	int i_op;
+	int i_x;                  /* set, save slot, or jump target */
+	int i_y;                  /* second split target */
+} inst_t;
+
+typedef struct prog_t {
+	inst_t *p_inst;
+	int p_n;
+	int p_max;
+} prog_t;
+
+typedef struct dstate_t {
+	int *d_pcs;               /* threads, highest priority first */
+	int d_npc;
+	int d_prevnl;             /* last char consumed was a newline */
+	int d_chain;              /* next state in hash chain */
+	int d_end[2];             /* match before end of line, -1 unknown */
+	int d_next[256];          /* next state << 1 | match, -1 unknown */
+} dstate_t;
+
+typedef struct dfa_t {
+	prog_t *f_prog;
+	int f_entry;              /* first instruction */
+	int f_truncate;           /* leftmost first, drop threads below a match */
+	dstate_t **f_st;
+	int f_nst;
+	int f_hash[RX_HASH];
+} dfa_t;
+
+typedef struct rx_t {
+	char_t (*r_set)[32];      /* char sets, one bit per char */
+	int r_nset;
+	int r_ngroup;
+	prog_t r_fwd;
+	prog_t r_rev;
+	dfa_t r_dfwd;             /* unanchored forward, leftmost first */
+	dfa_t r_dstart;           /* anchored reverse, longest */
+	dfa_t r_dback;            /* unanchored reverse */
+	int *r_mark;              /* scratch for closures */
+	int r_gen;
+	int *r_stack;
+	int *r_list;
+	int *r_next;
+	long *r_threads;          /* Pike VM thread lists */
+} rx_t;
+
+typedef struct parse_t {
+	char_t *s;
+	rx_t *rx;
+	char *err;
+	node_t *nodes;
+} parse_t;
+
+#define INSET(rx, n, c)  ((rx)->r_set[n][(c) >> 3] & (1 << ((c) & 7)))
+#define NCAP            (2 * RX_NGROUP)
+
+// PARSING ////////////////////////////////////////////////////////////////////
+
+static node_t *node(parse_t *ps, int type, int val, node_t *l, node_t *r)
+{
+	node_t *n = (node_t *) malloc(sizeof (node_t));
+
+	if (n == NULL) {
+		ps->err = "out of memory";
+		return (NULL);
+	}
+	n->n_type = type;
+	n->n_val = val;
+	n->n_left = l;
+	n->n_right = r;
+	n->n_next = ps->nodes;
+	ps->nodes = n;
+	return (n);
+}
+
+static int newset(parse_t *ps)
+{
+	rx_t *rx = ps->rx;
+	char_t (*set)[32] = realloc(rx->r_set, (rx->r_nset + 1) * sizeof (*set));
+
+	if (set == NULL) {
+		ps->err = "out of memory";
+		return (-1);
+	}
+	rx->r_set = set;
+	memset(set[rx->r_nset], 0, sizeof (*set));
+	return (rx->r_nset++);
+}
+
+static void setrange(char_t *set, int lo, int hi)
+{
+	for (; lo <= hi; lo++)
+		set[lo >> 3] |= 1 << (lo & 7);
+}
+
+/* add the class named by escape c (\d \w \s) to set, FALSE if c is not one */
+static int setclass(char_t *set, int c)
+{
+	char_t tmp[32];
+	int i;
+
+	memset(tmp, 0, sizeof (tmp));
+	switch (c | 0x20) {
+	case 'd':
+		setrange(tmp, '0', '9');
+		break;
+	case 'w':
+		setrange(tmp, '0', '9');
+		setrange(tmp, 'a', 'z');
+		setrange(tmp, 'A', 'Z');
+		setrange(tmp, '_', '_');
+		break;
+	case 's':
+		setrange(tmp, ' ', ' ');
+		setrange(tmp, '\t', '\r');
+		break;
+	default:
+		return (0);
+	}
+	for (i = 0; i < 32; i++)
+		set[i] |= (c & 0x20) ? tmp[i] : ~tmp[i];
+	return (1);
+}
+
+static int escape(int c)
+{
+	switch (c) {
+	case 'n': return ('\n');
+	case 't': return ('\t');
+	case 'r': return ('\r');
+	case 'f': return ('\f');
+	}
+	return (c);
+}
+
+static node_t *parse_alt(parse_t *);
+
+static node_t *parse_class(parse_t *ps)
+{
+	int n, c, hi, negate = 0, i;
+	char_t *set;
+
+	if ((n = newset(ps)) < 0) return (NULL);
+	if (*ps->s == '^') {
+		negate = 1;
+		ps->s++;
+	}
+	/* a ] first in the class is literal */
+	for (i = 0; *ps->s != '\0' && (*ps->s != ']' || i == 0); i++) {
+		set = ps->rx->r_set[n];
+		c = *ps->s++;
+		if (c == '\\' && *ps->s != '\0') {
+			c = *ps->s++;
+			if (setclass(set, c)) continue;
+			c = escape(c);
+		}
+		if (*ps->s == '-' && ps->s[1] != ']' && ps->s[1] != '\0') {
+			ps->s++;
+			hi = *ps->s++;
+			if (hi == '\\' && *ps->s != '\0') hi = escape(*ps->s++);
+			if (hi < c) {
+				ps->err = "bad range in []";
+				return (NULL);
+			}
+			setrange(set, c, hi);
+		} else {
+			setrange(set, c, c);
+		}
+	}
+	if (*ps->s++ != ']') {
+		ps->err = "missing ]";
+		return (NULL);
+	}
+	if (negate) {
+		set = ps->rx->r_set[n];
+		for (i = 0; i < 32; i++)
+			set[i] = ~set[i];
+	}
+	return (node(ps, N_SET, n, NULL, NULL));
+}
+
+static node_t *parse_atom(parse_t *ps)
+{
+	node_t *n;
+	int c = *ps->s++, s, g;
+
+	switch (c) {
+	case '(':
+		if ((g = ps->rx->r_ngroup++) >= RX_NGROUP) {
+			ps->err = "too many groups";
+			return (NULL);
+		}
+		if ((n = parse_alt(ps)) == NULL) return (NULL);
+		if (*ps->s++ != ')') {
+			ps->err = "missing )";
+			return (NULL);
+		}
+		return (node(ps, N_GROUP, g, n, NULL));
+	case '[':
+		return (parse_class(ps));
+	case '^':
+		return (node(ps, N_BOL, 0, NULL, NULL));
+	case '$':
+		return (node(ps, N_EOL, 0, NULL, NULL));
+	case '*':
+	case '+':
+	case '?':
+		ps->err = "nothing to repeat";
+		return (NULL);
+	}
+
+	if ((s = newset(ps)) < 0) return (NULL);
+	if (c == '.') {
+		setrange(ps->rx->r_set[s], 0, 255);
+		ps->rx->r_set[s]['\n' >> 3] &= ~(1 << ('\n' & 7));
+	} else if (c == '\\') {
+		if ((c = *ps->s++) == '\0') {
+			ps->err = "trailing \\";
+			return (NULL);
+		}
+		if (!setclass(ps->rx->r_set[s], c))
+			setrange(ps->rx->r_set[s], escape(c), escape(c));
+	} else {
+		setrange(ps->rx->r_set[s], c, c);
+	}
+	return (node(ps, N_SET, s, NULL, NULL));
+}
+
+static node_t *parse_repeat(parse_t *ps)
+{
+	node_t *n = parse_atom(ps);
+
+	int type, lazy;
+
+	while (n != NULL && *ps->s != '\0' && strchr("*+?", *ps->s) != NULL) {
+		type = (*ps->s == '*' ? N_STAR : *ps->s == '+' ? N_PLUS : N_QUEST);
+		/* a trailing ? makes the repeat match as little as it can */
+		if ((lazy = (ps->s[1] == '?')))
+			ps->s++;
+		ps->s++;
+		n = node(ps, type, lazy, n, NULL);
+	}
+	return (n);
+}
+
+static node_t *parse_cat(parse_t *ps)
+{
+	node_t *n = node(ps, N_EMPTY, 0, NULL, NULL), *r;
+
+	while (n != NULL && *ps->s != '\0' && *ps->s != '|' && *ps->s != ')') {
+		if ((r = parse_repeat(ps)) == NULL) return (NULL);
+		n = node(ps, N_CAT, 0, n, r);
+	}
+	return (n);
+}
+
+static node_t *parse_alt(parse_t *ps)
+{
+	node_t *n = parse_cat(ps), *r;
+
+	while (n != NULL && *ps->s == '|') {
+		ps->s++;
+		if ((r = parse_cat(ps)) == NULL) return (NULL);
+		n = node(ps, N_ALT, 0, n, r);
+	}
+	return (n);
+}
+
+// COMPILING //////////////////////////////////////////////////////////////////
+
+static int emit(prog_t *pg, int op, int x, int y)
+{
+	inst_t *in;
+
+	if (pg->p_n == pg->p_max) {
+		if (RX_MAXINST <= pg->p_max) return (-1);
+		pg->p_max = (pg->p_max == 0 ? 64 : pg->p_max * 2);
+		if ((in = (inst_t *) realloc(pg->p_inst, pg->p_max * sizeof (inst_t))) == NULL)
+			return (-1);
+		pg->p_inst = in;
+	}
+	pg->p_inst[pg->p_n].i_op = op;
+	pg->p_inst[pg->p_n].i_x = x;
+	pg->p_inst[pg->p_n].i_y = y;
+	return (pg->p_n++);
+}
+
+/* compile the tree, with concatenations and anchors reversed when rev */
+static int compile(prog_t *pg, node_t *n, int rev)
+{
+	int l, j;
+
+	switch (n->n_type) {
+	case N_SET:
+		return (emit(pg, I_SET, n->n_val, 0) < 0 ? -1 : 0);
+	case N_EMPTY:
+		return (0);
+	case N_BOL:
+		return (emit(pg, rev ? I_EOL : I_BOL, 0, 0) < 0 ? -1 : 0);
+	case N_EOL:
+		return (emit(pg, rev ? I_BOL : I_EOL, 0, 0) < 0 ? -1 : 0);
+	case N_CAT:
+		if (compile(pg, rev ? n->n_right : n->n_left, rev) < 0) return (-1);
+		return (compile(pg, rev ? n->n_left : n->n_right, rev));
+	case N_GROUP:
+		if (emit(pg, I_SAVE, 2 * n->n_val + rev, 0) < 0) return (-1);
+		if (compile(pg, n->n_left, rev) < 0) return (-1);
+		return (emit(pg, I_SAVE, 2 * n->n_val + !rev, 0) < 0 ? -1 : 0);
+	case N_ALT:
+		if ((l = emit(pg, I_SPLIT, pg->p_n + 1, 0)) < 0) return (-1);
+		if (compile(pg, n->n_left, rev) < 0) return (-1);
+		if ((j = emit(pg, I_JMP, 0, 0)) < 0) return (-1);
+		pg->p_inst[l].i_y = pg->p_n;
+		if (compile(pg, n->n_right, rev) < 0) return (-1);
+		pg->p_inst[j].i_x = pg->p_n;
+		return (0);
+	case N_STAR:
+		if ((l = emit(pg, I_SPLIT, pg->p_n + 1, 0)) < 0) return (-1);
+		if (compile(pg, n->n_left, rev) < 0) return (-1);
+		if (emit(pg, I_JMP, l, 0) < 0) return (-1);
+		pg->p_inst[l].i_y = pg->p_n;
+		break;
+	case N_PLUS:
+		j = pg->p_n;
+		if (compile(pg, n->n_left, rev) < 0) return (-1);
+		if ((l = emit(pg, I_SPLIT, j, pg->p_n + 1)) < 0) return (-1);
+		break;
+	case N_QUEST:
+		if ((l = emit(pg, I_SPLIT, pg->p_n + 1, 0)) < 0) return (-1);
+		if (compile(pg, n->n_left, rev) < 0) return (-1);
+		pg->p_inst[l].i_y = pg->p_n;
+		break;
+	default:
+		return (-1);
+	}
+
+	/* a lazy repeat prefers leaving to going round again */
+	if (n->n_val) {
+		j = pg->p_inst[l].i_x;
+		pg->p_inst[l].i_x = pg->p_inst[l].i_y;
+		pg->p_inst[l].i_y = j;
+	}
+	return (0);
+}
+
+/*
+ * Every program starts with a lazy loop over any char, so running it
+ * from instruction 0 searches and from instruction 3 is anchored:
+ *   0: split 3, 1   1: any   2: jmp 0   3: save 0   ...   save 1   match
+ */
+static int program(rx_t *rx, prog_t *pg, node_t *n, int rev, int any)
+{
+	if (emit(pg, I_SPLIT, 3, 1) < 0 || emit(pg, I_SET, any, 0) < 0 || emit(pg, I_JMP, 0, 0) < 0)
+		return (-1);
+	if (emit(pg, I_SAVE, rev, 0) < 0 || compile(pg, n, rev) < 0 || emit(pg, I_SAVE, !rev, 0) < 0)
+		return (-1);
+	return (emit(pg, I_MATCH, 0, 0) < 0 ? -1 : 0);
+}
+
+static void dfa_init(dfa_t *d, prog_t *pg, int entry, int truncate)
+{
+	d->f_prog = pg;
+	d->f_entry = entry;
+	d->f_truncate = truncate;
+	d->f_st = NULL;
+	d->f_nst = 0;
+	memset(d->f_hash, -1, sizeof (d->f_hash));
+}
+
+static void dfa_flush(dfa_t *d)
+{
+	int i;
+
+	for (i = 0; i < d->f_nst; i++) {
+		free(d->f_st[i]->d_pcs);
+		free(d->f_st[i]);
+	}
+	d->f_nst = 0;
+	memset(d->f_hash, -1, sizeof (d->f_hash));
+}
+
+void rx_free(rx_t *rx)
+{
+	if (rx == NULL) return;
+	dfa_flush(&rx->r_dfwd);
+	dfa_flush(&rx->r_dstart);
+	dfa_flush(&rx->r_dback);
+	free(rx->r_dfwd.f_st);
+	free(rx->r_dstart.f_st);
+	free(rx->r_dback.f_st);
+	free(rx->r_set);
+	free(rx->r_fwd.p_inst);
+	free(rx->r_rev.p_inst);
+	free(rx->r_mark);
+	free(rx->r_stack);
+	free(rx->r_list);
+	free(rx->r_next);
+	free(rx->r_threads);
+	free(rx);
+}
+
+/* Compile a pattern, NULL with *err set if it is not valid */
+rx_t *rx_compile(char *pattern, char **err)
+{
+	parse_t ps;
+	node_t *n, *tree;
+	rx_t *rx;
+	int any, ni;
+
+	if ((rx = (rx_t *) calloc(1, sizeof (rx_t))) == NULL) {
+		*err = "out of memory";
+		return (NULL);
+	}
+	rx->r_ngroup = 1;
+	ps.s = (char_t *) pattern;
+	ps.rx = rx;
+	ps.err = NULL;
+	ps.nodes = NULL;
+
+	if ((any = newset(&ps)) >= 0)
+		setrange(rx->r_set[any], 0, 255);
+	tree = parse_alt(&ps);
+	if (tree != NULL && *ps.s != '\0')
+		ps.err = "unmatched )";
+	if (tree != NULL && ps.err == NULL &&
+	    (program(rx, &rx->r_fwd, tree, 0, any) < 0 || program(rx, &rx->r_rev, tree, 1, any) < 0))
+		ps.err = "pattern too big";
+
+	for (; ps.nodes != NULL; ps.nodes = n) {
+		n = ps.nodes->n_next;
+		free(ps.nodes);
+	}
+
+	ni = rx->r_fwd.p_n;
+	if (ps.err == NULL) {
+		rx->r_mark = (int *) calloc(ni, sizeof (int));
+		rx->r_stack = (int *) malloc(2 * ni * sizeof (int));
+		rx->r_list = (int *) malloc(ni * sizeof (int));
+		rx->r_next = (int *) malloc(ni * sizeof (int));
+		rx->r_threads = (long *) malloc(2 * ni * (1 + NCAP) * sizeof (long));
+		if (!rx->r_mark || !rx->r_stack || !rx->r_list || !rx->r_next || !rx->r_threads)
+			ps.err = "out of memory";
+	}
+	if (ps.err != NULL) {
+		*err = ps.err;
+		rx_free(rx);
+		return (NULL);
+	}
+
+	dfa_init(&rx->r_dfwd, &rx->r_fwd, 0, 1);
+	dfa_init(&rx->r_dstart, &rx->r_rev, 3, 0);
+	dfa_init(&rx->r_dback, &rx->r_rev, 0, 0);
+	return (rx);
+}
+
+// LAZY DFA ///////////////////////////////////////////////////////////////////
+
+/*
+ * Follow the empty transitions from threads in priority order, putting
+ * the threads waiting on a char into r_list.  Returns TRUE if a match was
+ * reached; when truncating, lower priority threads are dropped there.
+ */
+static int closure(rx_t *rx, dfa_t *d, int *pcs, int npc, int prevnl, int nextnl, int *nlist)
+{
+	inst_t *in = d->f_prog->p_inst;
+	int *stack = rx->r_stack;
+	int i, sp, pc, matched = 0, n = 0;
+
+	rx->r_gen++;
+	for (i = 0; i < npc; i++) {
+		stack[0] = pcs[i];
+		for (sp = 1; 0 < sp; ) {
+			pc = stack[--sp];
+			if (rx->r_mark[pc] == rx->r_gen) continue;
+			rx->r_mark[pc] = rx->r_gen;
+			switch (in[pc].i_op) {
+			case I_JMP:
+				stack[sp++] = in[pc].i_x;
+				break;
+			case I_SPLIT:
+				stack[sp++] = in[pc].i_y;
+				stack[sp++] = in[pc].i_x;
+				break;
+			case I_SAVE:
+				stack[sp++] = pc + 1;
+				break;
+			case I_BOL:
+				if (prevnl) stack[sp++] = pc + 1;
+				break;
+			case I_EOL:
+				if (nextnl) stack[sp++] = pc + 1;
+				break;
+			case I_SET:
+				rx->r_list[n++] = pc;
+				break;
+			case I_MATCH:
+				matched = 1;
+				if (d->f_truncate) {
+					*nlist = n;
+					return (matched);
+				}
+				break;
+			}
+		}
+	}
+	*nlist = n;
+	return (matched);
+}
+
+/* Find or make the state for a list of threads, -1 if out of memory */
+static int dstate(dfa_t *d, int *pcs, int npc, int prevnl)
+{
+	dstate_t *ds, **st;
+	unsigned h = 2166136261u + prevnl;
+	int i;
+
+	for (i = 0; i < npc; i++)
+		h = (h ^ pcs[i]) * 16777619u;
+	h %= RX_HASH;
+
+	for (i = d->f_hash[h]; 0 <= i; i = d->f_st[i]->d_chain) {
+		ds = d->f_st[i];
+		if (ds->d_npc == npc && ds->d_prevnl == prevnl && memcmp(ds->d_pcs, pcs, npc * sizeof (int)) == 0)
+			return (i);
+	}
+
+	if ((d->f_nst & 63) == 0) {
+		if ((st = (dstate_t **) realloc(d->f_st, (d->f_nst + 64) * sizeof (dstate_t *))) == NULL)
+			return (-1);
+		d->f_st = st;
+	}
+	if ((ds = (dstate_t *) malloc(sizeof (dstate_t))) == NULL)
+		return (-1);
+	if ((ds->d_pcs = (int *) malloc((npc + 1) * sizeof (int))) == NULL) {
+		free(ds);
+		return (-1);
+	}
+	memcpy(ds->d_pcs, pcs, npc * sizeof (int));
+	ds->d_npc = npc;
+	ds->d_prevnl = prevnl;
+	ds->d_end[0] = ds->d_end[1] = -1;
+	memset(ds->d_next, -1, sizeof (ds->d_next));
+	ds->d_chain = d->f_hash[h];
+	d->f_hash[h] = d->f_nst;
+	d->f_st[d->f_nst] = ds;
+	return (d->f_nst++);
+}
+
+static int dstart(dfa_t *d, int prevnl)
+{
+	return (dstate(d, &d->f_entry, 1, prevnl));
+}
+
+/* Is there a match in state s when the next char is (or is not) a newline */
+static int dmatch(rx_t *rx, dfa_t *d, int s, int nextnl)
+{
+	dstate_t *ds = d->f_st[s];
+	int n;
+
+	if (ds->d_end[nextnl] < 0)
+		ds->d_end[nextnl] = closure(rx, d, ds->d_pcs, ds->d_npc, ds->d_prevnl, nextnl, &n);
+	return (ds->d_end[nextnl]);
+}
+
+/* Work out the transition of state *s on c, flushing the cache if it is full */
+static int dnext(rx_t *rx, dfa_t *d, int *s, int c)
+{
+	dstate_t *ds = d->f_st[*s];
+	inst_t *in = d->f_prog->p_inst;
+	int i, n, nn = 0, t, matched, pc;
+	int *copy;
+
+	matched = closure(rx, d, ds->d_pcs, ds->d_npc, ds->d_prevnl, c == '\n', &n);
+	rx->r_gen++;
+	for (i = 0; i < n; i++) {
+		pc = rx->r_list[i] + 1;
+		if (INSET(rx, in[pc - 1].i_x, c) && rx->r_mark[pc] != rx->r_gen) {
+			rx->r_mark[pc] = rx->r_gen;
+			rx->r_next[nn++] = pc;
+		}
+	}
+
+	if (RX_MAXSTATE <= d->f_nst) {
+		/* keep the state we are in, everything else goes */
+		if ((copy = (int *) malloc((ds->d_npc + 1) * sizeof (int))) == NULL) return (-1);
+		memcpy(copy, ds->d_pcs, ds->d_npc * sizeof (int));
+		n = ds->d_npc;
+		i = ds->d_prevnl;
+		dfa_flush(d);
+		*s = dstate(d, copy, n, i);
+		free(copy);
+		if (*s < 0) return (-1);
+	}
+	if ((t = dstate(d, rx->r_next, nn, c == '\n')) < 0) return (-1);
+	return (d->f_st[*s]->d_next[c] = (t << 1) | matched);
+}
+
+static int char_at(long off)
+{
+	long n;
+	char_t *p = span_curbp(off, &n);
+
+	return (p == NULL ? -1 : *p);
+}
+
+/* Run forwards from start, return where the leftmost match ends, -1 if none */
+static long dfa_forward(rx_t *rx, dfa_t *d, long start)
+{
+	dstate_t *ds;
+	char_t *p;
+	long off, n, i, last = -1;
+	int s, e;
+
+	if ((s = dstart(d, start == 0 || char_at(start - 1) == '\n')) < 0) return (-1);
+	ds = d->f_st[s];
+	for (off = start; (p = span_curbp(off, &n)) != NULL; off += n) {
+		for (i = 0; i < n; i++) {
+			if ((e = ds->d_next[p[i]]) < 0) {
+				if ((e = dnext(rx, d, &s, p[i])) < 0) return (-1);
+				ds = NULL;
+			}
+			if (e & 1) last = off + i;
+			/* most chars leave the state as it is */
+			if ((e >> 1) != s || ds == NULL) {
+				ds = d->f_st[s = e >> 1];
+				if (ds->d_npc == 0) return (last);
+			}
+		}
+	}
+	return (dmatch(rx, d, s, 1) ? off : last);
+}
+
+/*
+ * Run the reverse program back from start to no further than lo.  Returns
+ * where the first match is found when first is set, otherwise where the
+ * longest one is, -1 if there is none.
+ */
+static long dfa_backward(rx_t *rx, dfa_t *d, long start, long lo, int first)
+{
+	dstate_t *ds;
+	char_t *p;
+	long off, n, i, last = -1;
+	int s, e, c;
+
+	if ((s = dstart(d, (c = char_at(start)) < 0 || c == '\n')) < 0) return (-1);
+	ds = d->f_st[s];
+	for (off = start; lo < off && (p = rspan_curbp(off, &n)) != NULL; off -= n) {
+		if (off - n < lo) {
+			p += lo - (off - n);
+			n = off - lo;
+		}
+		for (i = n - 1; 0 <= i; i--) {
+			if ((e = ds->d_next[p[i]]) < 0) {
+				if ((e = dnext(rx, d, &s, p[i])) < 0) return (-1);
+				ds = NULL;
+			}
+			if (e & 1) {
+				last = off - n + i + 1;
+				if (first) return (last);
+			}
+			if ((e >> 1) != s || ds == NULL) {
+				ds = d->f_st[s = e >> 1];
+				if (ds->d_npc == 0) return (last);
+			}
+		}
+	}
+	return (dmatch(rx, d, s, (c = char_at(off - 1)) < 0 || c == '\n') ? off : last);
+}
+
+// PIKE VM ////////////////////////////////////////////////////////////////////
+
+/* Add a thread and those it reaches without consuming a char, in priority order */
+static void addthread(rx_t *rx, long *list, int *n, int pc, long *caps, long pos, int prevnl, int nextnl)
+{
+	inst_t *in = rx->r_fwd.p_inst;
+	long *t, old;
+
+	if (rx->r_mark[pc] == rx->r_gen) return;
+	rx->r_mark[pc] = rx->r_gen;
+
+	switch (in[pc].i_op) {
+	case I_JMP:
+		addthread(rx, list, n, in[pc].i_x, caps, pos, prevnl, nextnl);
+		break;
+	case I_SPLIT:
+		addthread(rx, list, n, in[pc].i_x, caps, pos, prevnl, nextnl);
+		addthread(rx, list, n, in[pc].i_y, caps, pos, prevnl, nextnl);
+		break;
+	case I_SAVE:
+		old = caps[in[pc].i_x];
+		caps[in[pc].i_x] = pos;
+		addthread(rx, list, n, pc + 1, caps, pos, prevnl, nextnl);
+		caps[in[pc].i_x] = old;
+		break;
+	case I_BOL:
+		if (prevnl) addthread(rx, list, n, pc + 1, caps, pos, prevnl, nextnl);
+		break;
+	case I_EOL:
+		if (nextnl) addthread(rx, list, n, pc + 1, caps, pos, prevnl, nextnl);
+		break;
+	default:
+		t = list + (*n)++ * (1 + NCAP);
+		t[0] = pc;
+		memcpy(t + 1, caps, NCAP * sizeof (long));
+		break;
+	}
+}
+
+/* Run the anchored forward program from start, consuming nothing at or past limit */
+static int pike(rx_t *rx, long start, long limit, long *out)
+{
+	inst_t *in = rx->r_fwd.p_inst;
+	long *clist = rx->r_threads;
+	long *nlist = clist + rx->r_fwd.p_n * (1 + NCAP);
+	long *t, *swap, caps[NCAP], pos = start;
+	int i, nc = 0, nn, c, next, matched = 0;
+
+	for (i = 0; i < NCAP; i++)
+		caps[i] = -1;
+	c = char_at(pos);
+	rx->r_gen++;
+	addthread(rx, clist, &nc, 3, caps, pos, pos == 0 || char_at(pos - 1) == '\n', c < 0 || c == '\n');
+
+	while (0 < nc) {
+		next = char_at(pos + 1);
+		nn = 0;
+		rx->r_gen++;
+		for (i = 0; i < nc; i++) {
+			t = clist + i * (1 + NCAP);
+			if (in[t[0]].i_op == I_MATCH) {
+				memcpy(out, t + 1, NCAP * sizeof (long));
+				matched = 1;
+				break;
+			}
+			if (pos < limit && 0 <= c && INSET(rx, in[t[0]].i_x, c))
+				addthread(rx, nlist, &nn, t[0] + 1, t + 1, pos + 1, c == '\n', next < 0 || next == '\n');
+		}
+		swap = clist;
+		clist = nlist;
+		nlist = swap;
+		nc = nn;
+		c = next;
+		pos++;
+	}
+	return (matched);
+}
+
+// SEARCHING //////////////////////////////////////////////////////////////////
+
+/* Search forward from start, filling caps and returning the start of the match, -1 if none */
+long rx_search(rx_t *rx, long start, long *caps)
+{
+	long s, e;
+
+	if (start < 0) start = 0;
+	if (size_curbp() < start) return (-1);
+	if ((e = dfa_forward(rx, &rx->r_dfwd, start)) < 0) return (-1);
+	if ((s = dfa_backward(rx, &rx->r_dstart, e, start, 0)) < 0) s = start;
+	if (!pike(rx, s, e, caps)) {
+		caps[0] = s;
+		caps[1] = e;
+	}
+	return (caps[0]);
+}
+
+/* Search backward for the last match starting at or before start and ending by it */
+long rx_search_back(rx_t *rx, long start, long *caps)
+{
+	long s;
+
+	if (size_curbp() < start) start = size_curbp();
+	if (start < 0) return (-1);
+	if ((s = dfa_backward(rx, &rx->r_dback, start, 0, 1)) < 0) return (-1);
+	if (!pike(rx, s, start, caps)) {
+		caps[0] = caps[1] = s;
+	}
+	return (caps[0]);
+}
+
+/* Number of groups in the pattern, counting the whole match as group 0 */
+int rx_ngroup(rx_t *rx)
+{
+	return (rx->r_ngroup);
+}
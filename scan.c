@@ -0,0 +1,218 @@
+/* scan.c, newline and tab scanning kernels for zepl, Public Domain */
+
+/*
+ * The display and cursor motion code only cares about newlines and tabs,
+ * every other char is one column wide.  These kernels find those two
+ * chars sixteen or thirty two at a time, so the callers can step over
+ * runs of ordinary text with a little arithmetic.  AVX2 is used when the
+ * cpu has it, SSE2 otherwise, and plain C on anything that is not x86.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+typedef unsigned char char_t;
+
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+static char_t *nltab_c(char_t *p, char_t *e)
+{
+	for (; p < e; ++p)
+		if (*p == '\n' || *p == '\t')
+			return (p);
+	return (e);
+}
+
+static char_t *nlrev_c(char_t *p, char_t *e)
+{
+	while (p < e)
+		if (*--e == '\n')
+			return (e);
+	return (NULL);
+}
+
+static long nlcount_c(char_t *p, char_t *e)
+{
+	long c = 0;
+
+	for (; p < e; ++p)
+		c += (*p == '\n');
+	return (c);
+}
+
+#ifdef SCAN_X86
+static char_t *nltab_sse2(char_t *p, char_t *e)
+{
+	__m128i nl = _mm_set1_epi8('\n'), tab = _mm_set1_epi8('\t');
+	int m;
+
+	for (; 16 <= e - p; p += 16) {
+		__m128i v = _mm_loadu_si128((__m128i *) p);
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, tab)));
+		if (m != 0)
+			return (p + __builtin_ctz(m));
+	}
+	return (nltab_c(p, e));
+}
+
+static char_t *nlrev_sse2(char_t *p, char_t *e)
+{
+	__m128i nl = _mm_set1_epi8('\n');
+	int m;
+
+	for (; 16 <= e - p; e -= 16) {
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (e - 16)), nl));
+		if (m != 0)
+			return (e - 16 + (31 - __builtin_clz(m)));
+	}
+	return (nlrev_c(p, e));
+}
+
+static long nlcount_sse2(char_t *p, char_t *e)
+{
+	__m128i nl = _mm_set1_epi8('\n');
+	long c = 0;
+
+	for (; 16 <= e - p; p += 16)
+		c += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) p), nl)));
+	return (c + nlcount_c(p, e));
+}
+
+__attribute__((target("avx2")))
+static char_t *nltab_avx2(char_t *p, char_t *e)
+{
+	__m256i nl = _mm256_set1_epi8('\n'), tab = _mm256_set1_epi8('\t');
+	unsigned m;
+
+	for (; 32 <= e - p; p += 32) {
+		__m256i v = _mm256_loadu_si256((__m256i *) p);
+		m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, tab)));
+		if (m != 0)
+			return (p + __builtin_ctz(m));
+	}
+	return (nltab_sse2(p, e));
+}
+
+__attribute__((target("avx2")))
+static char_t *nlrev_avx2(char_t *p, char_t *e)
+{
+	__m256i nl = _mm256_set1_epi8('\n');
+	unsigned m;
+
+	for (; 32 <= e - p; e -= 32) {
+		m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) (e - 32)), nl));
+		if (m != 0)
+			return (e - 32 + (31 - __builtin_clz(m)));
+	}
+	return (nlrev_sse2(p, e));
+}
+
+__attribute__((target("avx2,popcnt")))
+static long nlcount_avx2(char_t *p, char_t *e)
+{
+	__m256i nl = _mm256_set1_epi8('\n');
+	long c = 0;
+
+	for (; 32 <= e - p; p += 32)
+		c += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) p), nl)));
+	return (c + nlcount_sse2(p, e));
+}
+#endif
+
+static char_t *(*nltab)(char_t *, char_t *) = NULL;
+static char_t *(*nlrev)(char_t *, char_t *) = NULL;
+static long (*nlcount)(char_t *, char_t *) = NULL;
+
+static void scan_init()
+{
+	nltab = nltab_c;
+	nlrev = nlrev_c;
+	nlcount = nlcount_c;
+#ifdef SCAN_X86
+	nltab = nltab_sse2;
+	nlrev = nlrev_sse2;
+	nlcount = nlcount_sse2;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		nltab = nltab_avx2;
+		nlrev = nlrev_avx2;
+		if (__builtin_cpu_supports("popcnt"))
+			nlcount = nlcount_avx2;
+	}
+#endif
+}
+
+/* Return the first newline or tab in [p, e), e if there is none */
+char_t *scan_nltab(char_t *p, char_t *e)
+{
+	if (nltab == NULL) scan_init();
+	return (nltab(p, e));
+}
+
+/* Return the last newline in [p, e), NULL if there is none */
+char_t *scan_nlrev(char_t *p, char_t *e)
+{
+	if (nlrev == NULL) scan_init();
+	return (nlrev(p, e));
+}
+
+/* Return the number of newlines in [p, e) */
+long scan_nlcount(char_t *p, char_t *e)
+{
+	if (nlcount == NULL) scan_init();
+	return (nlcount(p, e));
+}
+
+/* Fill the Horspool skip table for the m char pattern s */
+void scan_skip(char_t *s, long m, long *skip)
+{
+	long i;
+
+	for (i = 0; i < 256; i++)
+		skip[i] = m;
+	for (i = 0; i < m - 1; i++)
+		skip[s[i]] = m - 1 - i;
+}
+
+/* Return the first match of the m char pattern s in [p, e), NULL if none */
+char_t *scan_find(char_t *p, char_t *e, char_t *s, long m, long *skip)
+{
+	char_t last = s[m - 1];
+	char_t *q;
+
+	if (m == 1)
+		return (memchr(p, *s, e - p));
+
+	/* Horspool, jumping on the char under the end of the pattern */
+	for (q = p + m - 1; q < e; q += skip[*q])
+		if (*q == last && memcmp(q - m + 1, s, m - 1) == 0)
+			return (q - m + 1);
+	return (NULL);
+}
+
+/* As scan_skip(), for scan_rfind(), shifts keyed on the char under the start */
+void scan_rskip(char_t *s, long m, long *skip)
+{
+	long i;
+
+	for (i = 0; i < 256; i++)
+		skip[i] = m;
+	for (i = m - 1; 0 < i; i--)
+		skip[s[i]] = i;
+}
+
+/* Return the last match of the m char pattern s in [p, e), NULL if none */
+char_t *scan_rfind(char_t *p, char_t *e, char_t *s, long m, long *skip)
+{
+	char_t first = s[0];
+	long k;
+
+	/* Horspool run backwards, jumping on the char under the start of the pattern */
+	for (k = (e - p) - m; 0 <= k; k -= skip[p[k]])
+		if (p[k] == first && memcmp(p + k + 1, s + 1, m - 1) == 0)
+			return (p + k);
+	return (NULL);
+}
@@ -6,9 +6,15 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <ctype.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 
 #define E_NAME          "zepl"
 #define E_VERSION       "v0.9"
@@ -17,12 +23,44 @@
 #define E_INITFILE      "zepl.rc"
 
 #define B_MODIFIED	0x01		/* modified buffer */
+#define B_PIECE		0x02		/* text held in a piece table */
+#define B_MAPPED	0x04		/* pieces refer to a mapped file */
+#define B_LOAD		0x08		/* file not read until the buffer is first shown */
 #define MSGLINE         (LINES-1)
 #define CHUNK           8096L
 #define K_BUFFER_LENGTH 256
+#define INSERT_RUN      4096		/* most typed ahead chars inserted at once */
 #define MAX_FNAME       256
+#define MAX_BNAME       32
 #define TEMPBUF         512
 #define MIN_GAP_EXPAND  512
+#define MAX_GAP_EXPAND  (8L*1024*1024)	/* default cap on geometric gap growth */
+#define ADD_BLOCK       65536L
+#define MIN_PIECES      64
+#define PIECE_THRESHOLD (16L*1024*1024)	/* files this big get a piece table */
+#define AUTOSAVE_KEYS   300		/* auto save after this many keys */
+#define AUTOSAVE_SECS   30		/* or the first key after this long */
+#define LAT_WINDOW      1024		/* keys the latency histograms cover */
+#define HIST_SUB        16		/* buckets for each power of two */
+#define HIST_BUCKETS    (HIST_SUB * 32)
+#define LAT_READ        0		/* waiting in get_key */
+#define LAT_RUN         1		/* running the command bound to the key */
+#define LAT_PAINT       2		/* in display */
+#define LAT_PHASES      3
+#define TRACE_CMDS      128		/* commands a replay reports on */
+#define SAVE_IOV        64		/* spans handed to each writev() */
+#define WRAP_LONG       16384L		/* lines this long get wrap checkpoints */
+#define WRAP_GAP        4096L		/* chars between checkpoints */
+#define LINE_BLOCK      16384L		/* chars per newline index block */
+#define KILL_RING       32		/* kills kept for yank_pop */
+#define KILL_BUDGET     (16L*1024*1024)	/* bytes they may hold, the newest is kept anyway */
+#define UNDO_BLOCK      65536L		/* undo records are stacked in blocks this big */
+#define UNDO_RUN        20		/* typed chars that undo as one */
+#define U_INSERT        1
+#define U_DELETE        2
+#define OCCUR_CHUNK     (4L*1024*1024)	/* least text worth a thread of its own */
+#define OCCUR_THREADS   16
+#define OCCUR_SYNC      64		/* match starts kept to stitch chunks together */
 #define NOMARK          -1
 #define STRBUF_M        64
 #define MAX_KNAME       12
@@ -37,11 +75,111 @@ typedef struct keymap_t {
 	char k_bytes[MAX_KNAME + 1];      /* bytes of key sequence */
 	char k_funcname[MAX_KFUNC + 1];   /* name of function, eg (forward-char) */
 	void (*k_func)(void);             /* function pointer */
+	int k_form;                       /* k_funcname as read by compile_lisp(), -1 until run */
 	struct keymap_t *k_next;         /* link to next keymap_t */
 } keymap_t;
 
+/* keys by their bytes, one node per byte of a sequence */
+typedef struct knode_t {
+	keymap_t *kn_key;                 /* key whose bytes end here, if any */
+	struct knode_t **kn_next;         /* by the next byte, NULL if no key goes on */
+} knode_t;
+
+/* a named set of bindings, that shadow the global ones in buffers set to it */
+typedef struct keymode_t {
+	char km_name[MAX_KNAME + 1];
+	keymap_t *km_keys;
+	knode_t km_trie;
+	struct keymode_t *km_next;
+} keymode_t;
+
+/* piece table text is never moved, so pieces can point straight at it */
+typedef struct ablock_t {
+	struct ablock_t *a_next;  /* previously allocated block */
+	point_t a_size;           /* bytes allocated */
+	point_t a_used;           /* bytes used */
+	char_t *a_text;           /* the text, follows the block unless mapped */
+	char a_mapped;            /* text is a read only file mapping */
+} ablock_t;
+
+typedef struct piece_t {
+	char_t *p_text;           /* start of text in an add block */
+	point_t p_len;            /* length of piece, never zero */
+	point_t p_off;            /* buffer offset of first char */
+} piece_t;
+
+/* screen line starts along one long line, so moving about in it need not scan from its start */
+typedef struct wrap_t {
+	point_t w_line;           /* start of the line, NOMARK when none is cached */
+	point_t w_clear;          /* there is no newline in [w_line, w_clear) */
+	int w_cols;               /* COLS they were found for */
+	point_t *w_ck;            /* screen line starts about WRAP_GAP apart, w_ck[0] is w_line */
+	int w_n;
+	int w_m;
+} wrap_t;
+
+/* newline counts for consecutive blocks of text, summed by Fenwick trees */
+typedef struct lindex_t {
+	int l_nblock;             /* blocks in use */
+	int l_mblock;             /* blocks allocated */
+	point_t *l_size;          /* chars in each block */
+	point_t *l_nl;            /* newlines in each block */
+	point_t *l_fsize;         /* Fenwick tree over l_size */
+	point_t *l_fnl;           /* Fenwick tree over l_nl */
+} lindex_t;
+
+/* an edit kept for undo, u_len chars of text follow it in its block */
+typedef struct undo_t {
+	struct undo_t *u_prev;    /* edit before this one */
+	point_t u_off;
+	point_t u_len;
+	unsigned long u_seq;      /* command that made it, undone together */
+	char u_type;              /* U_INSERT or U_DELETE */
+} undo_t;
+
+/* undo records are only ever pushed and popped, so blocks are used as a stack */
+typedef struct ublock_t {
+	struct ublock_t *ub_prev;
+	size_t ub_size;           /* bytes after the header */
+	size_t ub_used;
+} ublock_t;
+
+typedef struct ustack_t {
+	ublock_t *us_block;       /* newest block */
+	undo_t *us_top;           /* newest record, always in the newest block */
+	long us_depth;            /* records on the stack */
+} ustack_t;
+
+/* a contiguous run of text, so occur threads need not touch the buffer */
+typedef struct seg_t {
+	char_t *s_text;
+	point_t s_off;            /* buffer offset of first char */
+	point_t s_len;
+} seg_t;
+
+/* the work of one occur thread, matches starting in [o_lo, o_hi) */
+typedef struct occur_t {
+	seg_t *o_seg;             /* the whole text, shared by all threads */
+	int o_nseg;
+	point_t o_size;
+	char_t *o_s;              /* pattern, its length and skip table */
+	point_t o_m;
+	long *o_skip;
+	char_t *o_win;            /* 2*o_m chars for matches straddling segments */
+	point_t o_lo;
+	point_t o_hi;
+	point_t o_count;          /* matches found */
+	point_t o_end;            /* end of the last one */
+	point_t *o_match;         /* their starts, all or the first OCCUR_SYNC */
+	point_t o_nmatch;
+	point_t o_mmatch;
+	int o_all;
+	int o_failed;             /* out of memory */
+} occur_t;
+
 typedef struct buffer_t
 {
+	struct buffer_t *b_next;  /* next buffer in the list */
 	point_t b_mark;	     	  /* the mark */
 	point_t b_point;          /* the point */
 	point_t b_page;           /* start of page */
@@ -55,9 +193,78 @@ typedef struct buffer_t
 	int b_row;                /* cursor row */
 	int b_col;                /* cursor col */
 	char b_fname[MAX_FNAME + 1]; /* filename */
+	char b_bname[MAX_BNAME + 1]; /* buffer name */
 	char b_flags;             /* buffer flags */
+	piece_t *b_piece;         /* piece table, when B_PIECE */
+	int b_npiece;             /* pieces in use */
+	int b_mpiece;             /* pieces allocated */
+	int b_cpiece;             /* piece last found */
+	ablock_t *b_add;          /* add blocks, newest first */
+	lindex_t *b_lines;        /* newline index, built when first needed */
+	wrap_t b_wrap;            /* checkpoints along the last long line moved in */
+	unsigned long b_edits;    /* count of changes, for anything caching the text */
+	ustack_t b_undo;          /* edits that can be undone, newest on top */
+	ustack_t b_redo;          /* edits undone since the last change */
+	unsigned long b_asedits;  /* b_edits when last auto saved */
+	long b_usaved;            /* b_undo depth when the text was as saved, -1 if lost */
+	point_t b_dlo;            /* text changed since the last display is in */
+	point_t b_dhi;            /* [b_dlo, b_dhi), NOMARK if none has */
+	keymode_t *b_mode;        /* keys of its own, NULL if none */
 } buffer_t;
 
+/* times in microseconds of the last LAT_WINDOW keys, bucketed with about 6% precision */
+typedef struct hist_t {
+	long h_count[HIST_BUCKETS];
+	short h_ring[LAT_WINDOW]; /* bucket of each time, the oldest at h_next once full */
+	int h_next;
+	int h_n;                  /* times in the window */
+} hist_t;
+
+/* the rows of the window as painted, so the next display can leave alone those that still show the same */
+typedef struct frame_t {
+	buffer_t *f_bp;           /* buffer shown, NULL if the screen no longer shows it */
+	int f_rows;
+	int f_mrows;              /* rows allocated */
+	int f_cols;               /* COLS when painted */
+	point_t f_size;           /* document size then */
+	point_t *f_start;         /* offset each row starts at, then the end of the last */
+	int *f_col;               /* column each row starts in, -1 for blank rows after the text, then after the last */
+} frame_t;
+
+/* an auto save under way, written from a snapshot by a thread of its own */
+typedef struct autosave_t {
+	buffer_t *as_bp;          /* buffer it is for, NULL when none is */
+	seg_t *as_seg;            /* the snapshot */
+	int as_nseg;
+	char_t *as_copy;          /* gap buffer text copied for it */
+	char as_fname[PATH_MAX];  /* auto save file */
+	pthread_t as_thread;
+	int as_done;              /* thread has finished, under as_lock */
+	int as_failed;
+} autosave_t;
+
+/* key bytes as read from the terminal and when, being recorded or replayed */
+typedef struct trace_t {
+	FILE *t_out;              /* trace being recorded, or NULL */
+	FILE *t_in;               /* trace being replayed, or NULL */
+	int t_fast;               /* replay without waiting for the recorded times */
+	struct timespec t_start;
+	int t_have;               /* the next replayed byte has been read: */
+	long t_us;                /* when it came, */
+	int t_wait;               /* if it was waited for or read ahead, */
+	int t_c;                  /* and the byte */
+	long t_keys;              /* keys replayed */
+	long t_paint;             /* microseconds painting after them */
+} trace_t;
+
+/* the run times of one command over a replay */
+typedef struct cmdstat_t {
+	char cs_name[MAX_KFUNC + 1];
+	long cs_count;
+	long cs_total;            /* microseconds */
+	long cs_max;
+} cmdstat_t;
+
 /*
  * Some compilers define size_t as a unsigned 16 bit number while
  * point_t and off_t might be defined as a signed 32 bit number.  
@@ -75,15 +282,61 @@ char temp[TEMPBUF];
 keymap_t *key_return;
 keymap_t *khead = NULL;
 keymap_t *ktail = NULL;
+knode_t ktrie;                  /* the keys of khead by their bytes */
+keymode_t *kmodes = NULL;
 buffer_t *curbp;
-point_t nscrap = 0;
-char_t *scrap = NULL;
+buffer_t *bheadp = NULL;      /* list of buffers */
+char_t *kring[KILL_RING];     /* killed and copied text, each NUL terminated */
+point_t klen[KILL_RING];
+int knew = KILL_RING - 1;     /* slot of the newest kill */
+int nkill = 0;
+point_t kbytes = 0;           /* held by the ring */
+point_t kbudget = KILL_BUDGET;
+point_t gap_cap = MAX_GAP_EXPAND; /* most a gap grows by beyond what is asked for */
+int kyank;                    /* slot last yanked */
+buffer_t *ybp = NULL;         /* where it was yanked, while yank_pop can replace it */
+point_t ystart;
+unsigned long yedits;
 char searchtext[STRBUF_M];
+int undoing = FALSE;          /* replaying edits, do not record them */
+unsigned long undo_seq = 0;   /* commands run so far */
+autosave_t autosave;
+frame_t frame[2];
+frame_t *fold = frame;        /* the frame on screen */
+int *fmatch = NULL;           /* row of it each new row matches, or -1 */
+hist_t lat[LAT_PHASES];
+char *lat_name[LAT_PHASES] = { "read", "run", "paint" };
+long lat_last[LAT_PHASES];    /* times of the last key */
+long lat_slowest = -1;        /* slowest command run, and what it was */
+char lat_slowfn[MAX_KFUNC + 1];
+int show_latency = FALSE;     /* in the modeline */
+char *lbuf = NULL;            /* a row of text as it is painted */
+int mlbuf = 0;
+int hold_display = 0;         /* commands being replayed, paint nothing until they are done */
+int placed = FALSE;           /* place_cursor() run since the last command began */
+char_t *kmacro = NULL;        /* key bytes of the keyboard macro */
+int kmlen = 0;
+int kmmax = 0;
+int kmstart = 0;              /* kmlen when the key being read began */
+int kdefining = FALSE;
+char_t *kplay = NULL;         /* next byte of the macro being played, NULL if none */
+char_t *kpend;
+int kback = -1;               /* a key byte read ahead and put back */
+int batch = FALSE;            /* run by --batch, with no terminal */
+trace_t ktrace;
+cmdstat_t cstat[TRACE_CMDS];
+int ncstat = 0;
+long cs_lost = 0;             /* runs of commands past TRACE_CMDS */
+long cs_lost_us = 0;          /* and their time */
+pthread_mutex_t as_lock = PTHREAD_MUTEX_INITIALIZER;
+int as_keys = 0;              /* keys since the last auto save */
+time_t as_time = 0;           /* and when it was */
 
 buffer_t* new_buffer()
 {
 	buffer_t *bp = (buffer_t *)malloc(sizeof(buffer_t));
 	assert(bp != NULL);
+	bp->b_next = NULL;
 	bp->b_point = 0;
 	bp->b_mark = NOMARK;
 	bp->b_page = 0;
@@ -93,7 +346,25 @@ buffer_t* new_buffer()
 	bp->b_ebuf = NULL;
 	bp->b_gap = NULL;
 	bp->b_egap = NULL;
+	bp->b_piece = NULL;
+	bp->b_npiece = 0;
+	bp->b_mpiece = 0;
+	bp->b_cpiece = 0;
+	bp->b_add = NULL;
+	bp->b_lines = NULL;
+	bp->b_wrap.w_line = NOMARK;
+	bp->b_wrap.w_ck = NULL;
+	bp->b_wrap.w_n = bp->b_wrap.w_m = 0;
+	bp->b_edits = 0;
+	bp->b_undo.us_block = bp->b_redo.us_block = NULL;
+	bp->b_undo.us_top = bp->b_redo.us_top = NULL;
+	bp->b_undo.us_depth = bp->b_redo.us_depth = 0;
+	bp->b_asedits = 0;
+	bp->b_usaved = 0;
+	bp->b_dlo = bp->b_dhi = NOMARK;
+	bp->b_mode = NULL;
 	bp->b_fname[0] = '\0';
+	bp->b_bname[0] = '\0';
 	bp->w_top = 0;	
 	bp->w_rows = LINES - 2;
 	return bp;
@@ -101,6 +372,11 @@ buffer_t* new_buffer()
 
 void fatal(char *msg)
 {
+	/* leave the terminal out of bracketed paste, as a clean exit does */
+	if (stdscr != NULL) {
+		putp("\x1B[?2004l");
+		fflush(stdout);
+	}
 	noraw();
 	endwin();
 	printf("\n%s %s:\n%s\n", E_NAME, E_VERSION, msg);
@@ -114,12 +390,58 @@ int msg(char *msg, ...)
 	(void)vsprintf(msgline, msg, args);
 	va_end(args);
 	msgflag = TRUE;
+	if (batch) fprintf(stderr, "%s\n", msgline);
 	return FALSE;
 }
 
+/* Return number of chars in the buffer */
+point_t document_size(buffer_t *bp)
+{
+	piece_t *pp;
+
+	if (bp->b_flags & B_PIECE) {
+		if (bp->b_npiece == 0) return 0;
+		pp = bp->b_piece + bp->b_npiece - 1;
+		return (pp->p_off + pp->p_len);
+	}
+	return ((bp->b_ebuf - bp->b_buf) - (bp->b_egap - bp->b_gap));
+}
+
+/* Index of the piece holding offset, b_npiece if offset is out of range */
+int findpiece(buffer_t *bp, point_t offset)
+{
+	piece_t *pp = bp->b_piece;
+	int lo = 0, hi = bp->b_npiece, mid;
+	int c = bp->b_cpiece;
+
+	/* scanning forward almost always hits the last piece or the next one */
+	for (mid = c; mid < c + 2 && mid < hi; mid++)
+		if (pp[mid].p_off <= offset && offset < pp[mid].p_off + pp[mid].p_len)
+			return (bp->b_cpiece = mid);
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (offset < pp[mid].p_off)
+			hi = mid;
+		else if (pp[mid].p_off + pp[mid].p_len <= offset)
+			lo = mid + 1;
+		else
+			return (bp->b_cpiece = mid);
+	}
+	return (bp->b_npiece);
+}
+
 /* Given a buffer offset, convert it to a pointer into the buffer */
 char_t * ptr(buffer_t *bp, register point_t offset)
 {
+	static char_t eob = '\0';
+	int i;
+
+	if (bp->b_flags & B_PIECE) {
+		if (offset < 0) offset = 0;
+		if ((i = findpiece(bp, offset)) == bp->b_npiece) return (&eob);
+		return (bp->b_piece[i].p_text + (offset - bp->b_piece[i].p_off));
+	}
 	if (offset < 0) return (bp->b_buf);
 	return (bp->b_buf+offset + (bp->b_buf + offset < bp->b_gap ? 0 : bp->b_egap-bp->b_gap));
 }
@@ -127,10 +449,48 @@ char_t * ptr(buffer_t *bp, register point_t offset)
 /* Given a pointer into the buffer, convert it to a buffer offset */
 point_t pos(buffer_t *bp, register char_t *cp)
 {
+	assert(!(bp->b_flags & B_PIECE));
 	assert(bp->b_buf <= cp && cp <= bp->b_ebuf);
 	return (cp - bp->b_buf - (cp < bp->b_egap ? 0 : bp->b_egap - bp->b_gap));
 }
 
+/* Return the contiguous run of text ending at offset, its length in *n */
+char_t *rspan(buffer_t *bp, point_t offset, point_t *n)
+{
+	point_t gap;
+	int i;
+
+	*n = 0;
+	if (offset <= 0 || document_size(bp) < offset) return (NULL);
+
+	if (bp->b_flags & B_PIECE) {
+		i = findpiece(bp, offset - 1);
+		*n = offset - bp->b_piece[i].p_off;
+		return (bp->b_piece[i].p_text);
+	}
+	gap = bp->b_gap - bp->b_buf;
+	*n = (offset <= gap ? offset : offset - gap);
+	return (offset <= gap ? bp->b_buf : bp->b_egap);
+}
+
+/* Return the contiguous run of text starting at offset, its length in *n */
+char_t *span(buffer_t *bp, point_t offset, point_t *n)
+{
+	char_t *p;
+	int i;
+
+	*n = 0;
+	if (offset < 0 || document_size(bp) <= offset) return (NULL);
+
+	if (bp->b_flags & B_PIECE) {
+		i = findpiece(bp, offset);
+		*n = bp->b_piece[i].p_len - (offset - bp->b_piece[i].p_off);
+		return (bp->b_piece[i].p_text + (offset - bp->b_piece[i].p_off));
+	}
+	p = ptr(bp, offset);
+	*n = (p < bp->b_gap ? bp->b_gap : bp->b_ebuf) - p;
+	return (p);
+}
 /* Enlarge gap by n chars, position of gap cannot change */
 int growgap(buffer_t *bp, point_t n)
 {
@@ -145,7 +505,8 @@ int growgap(buffer_t *bp, point_t n)
 	xegap = bp->b_egap - bp->b_buf;
 	buflen = bp->b_ebuf - bp->b_buf;
     
-	/* reduce number of reallocs by growing by a minimum amount */
+	/* grow by a quarter of the buffer, so repeated growth costs O(1) per char, never by less than asked */
+	if (n < buflen / 4 && n < gap_cap) n = (buflen / 4 < gap_cap ? buflen / 4 : gap_cap);
 	n = (n < MIN_GAP_EXPAND ? MIN_GAP_EXPAND : n);
 	newlen = buflen + n * sizeof (char_t);
 
@@ -164,11 +525,9 @@ int growgap(buffer_t *bp, point_t n)
 	 */
 	bp->b_buf = new;
 	bp->b_gap = bp->b_buf + xgap;      
-	bp->b_ebuf = bp->b_buf + buflen;
-	bp->b_egap = bp->b_buf + newlen;
-	while (xegap < buflen--)
-		*--bp->b_egap = *--bp->b_ebuf;
+	bp->b_egap = bp->b_buf + xegap + (newlen - buflen);
 	bp->b_ebuf = bp->b_buf + newlen;
+	memmove(bp->b_egap, bp->b_buf + xegap, (size_t) (buflen - xegap));
 
 	assert(bp->b_buf < bp->b_ebuf);          /* Buffer must exist. */
 	assert(bp->b_buf <= bp->b_gap);
@@ -177,467 +536,2711 @@ int growgap(buffer_t *bp, point_t n)
 	return (TRUE);
 }
 
+point_t gap_growth_cap(point_t n)
+{
+	if (0 <= n) gap_cap = (n < MIN_GAP_EXPAND ? MIN_GAP_EXPAND : n);
+	return (gap_cap);
+}
+
+/* Reduce gap to n chars and give the memory back, position of gap cannot change */
+void shrinkgap(buffer_t *bp, point_t n)
+{
+	char_t *new;
+	point_t xgap = bp->b_gap - bp->b_buf;
+	point_t tail = bp->b_ebuf - bp->b_egap;
+	point_t newlen = xgap + n + tail;
+
+	if (bp->b_egap - bp->b_gap <= n) return;
+	memmove(bp->b_gap + n, bp->b_egap, (size_t) tail);
+	/* a failed shrink leaves the old, larger, block in place */
+	if ((new = (char_t*) realloc(bp->b_buf, (size_t) newlen)) == NULL)
+		new = bp->b_buf;
+	bp->b_buf = new;
+	bp->b_gap = new + xgap;
+	bp->b_egap = bp->b_gap + n;
+	bp->b_ebuf = bp->b_egap + tail;
+}
+
 point_t movegap(buffer_t *bp, point_t offset)
 {
 	char_t *p = ptr(bp, offset);
-	while (p < bp->b_gap)
-		*--bp->b_egap = *--bp->b_gap;
-	while (bp->b_egap < p)
-		*bp->b_gap++ = *bp->b_egap++;
+	point_t n;
+
+	if (p < bp->b_gap) {
+		n = bp->b_gap - p;
+		bp->b_gap -= n;
+		bp->b_egap -= n;
+		memmove(bp->b_egap, bp->b_gap, (size_t) n);
+	} else if (bp->b_egap < p) {
+		n = p - bp->b_egap;
+		memmove(bp->b_gap, bp->b_egap, (size_t) n);
+		bp->b_gap += n;
+		bp->b_egap += n;
+	}
 	assert(bp->b_gap <= bp->b_egap);
 	assert(bp->b_buf <= bp->b_gap);
 	assert(bp->b_egap <= bp->b_ebuf);
 	return (pos(bp, bp->b_egap));
 }
 
-void save_buffer()
+/* Make room in the piece table for n more pieces */
+int growpieces(buffer_t *bp, int n)
 {
-	FILE *fp;
-	point_t length;
+	piece_t *new;
+	int m = bp->b_mpiece;
+
+	if (bp->b_npiece + n <= m) return (TRUE);
+	while (m < bp->b_npiece + n)
+		m = (m == 0 ? MIN_PIECES : m * 2);
+	if ((new = (piece_t *) realloc(bp->b_piece, m * sizeof (piece_t))) == NULL)
+		return msg("Failed to allocate required memory");
+	bp->b_piece = new;
+	bp->b_mpiece = m;
+	return (TRUE);
+}
 
-	fp = fopen(curbp->b_fname, "w");
-	if (fp == NULL) msg("Failed to open file \"%s\".", curbp->b_fname);
-	(void) movegap(curbp, (point_t) 0);
-	length = (point_t) (curbp->b_ebuf - curbp->b_egap);
-	if (fwrite(curbp->b_egap, sizeof (char), (size_t) length, fp) != length) 
-		msg("Failed to write file \"%s\".", curbp->b_fname);
-	fclose(fp);
-	curbp->b_flags &= ~B_MODIFIED;
-	msg("File \"%s\" %ld bytes saved.", curbp->b_fname, pos(curbp, curbp->b_ebuf));
+/* Recalculate the offsets of pieces from index i onwards */
+void fixpieces(buffer_t *bp, int i)
+{
+	piece_t *pp = bp->b_piece;
+	point_t off = (i == 0 ? 0 : pp[i-1].p_off + pp[i-1].p_len);
+
+	for (; i < bp->b_npiece; i++) {
+		pp[i].p_off = off;
+		off += pp[i].p_len;
+	}
 }
 
-/* reads file into buffer at point */
-int insert_file(char *fn, int modflag)
+/* Ensure a piece starts at offset, return its index or -1 on failure */
+int splitpiece(buffer_t *bp, point_t offset)
 {
-	FILE *fp;
-	size_t len;
-	struct stat sb;
+	piece_t *pp;
+	point_t d;
+	int i = findpiece(bp, offset);
+
+	if (i == bp->b_npiece || bp->b_piece[i].p_off == offset) return (i);
+	if (!growpieces(bp, 1)) return (-1);
+
+	pp = bp->b_piece + i;
+	memmove(pp + 1, pp, (bp->b_npiece - i) * sizeof (piece_t));
+	bp->b_npiece++;
+	d = offset - pp->p_off;
+	pp[0].p_len = d;
+	pp[1].p_text += d;
+	pp[1].p_len -= d;
+	pp[1].p_off = offset;
+	return (i + 1);
+}
 
-	if (stat(fn, &sb) < 0) return msg("Failed to find file \"%s\".", fn);
-	if (MAX_SIZE_T < sb.st_size) msg("File \"%s\" is too big to load.", fn);
+/* Allocate an add block with room for at least n chars */
+ablock_t *newblock(buffer_t *bp, point_t n)
+{
+	ablock_t *ab;
 
-	if (curbp->b_egap - curbp->b_gap < sb.st_size * sizeof (char_t) && !growgap(curbp, sb.st_size))
-		return (FALSE);
-	if ((fp = fopen(fn, "r")) == NULL) return msg("Failed to open file \"%s\".", fn);
+	n = (n < ADD_BLOCK ? ADD_BLOCK : n);
+	if (MAX_SIZE_T - sizeof (ablock_t) < n || (ab = (ablock_t *) malloc(sizeof (ablock_t) + n)) == NULL) {
+		msg("Failed to allocate required memory");
+		return (NULL);
+	}
+	ab->a_text = (char_t *)(ab + 1);
+	ab->a_size = n;
+	ab->a_used = 0;
+	ab->a_mapped = FALSE;
+	ab->a_next = bp->b_add;
+	bp->b_add = ab;
+	return (ab);
+}
 
-	curbp->b_point = movegap(curbp, curbp->b_point);
-	curbp->b_gap += len = fread(curbp->b_gap, sizeof (char), (size_t) sb.st_size, fp);
+/*
+ * Map a file read only into an add block of its own, NULL if it cannot be.
+ * The pages are shared with the page cache until touched, so opening a file
+ * costs no memory, but the file must never be truncated while it is mapped.
+ */
+ablock_t *mapblock(buffer_t *bp, char *fn, point_t n)
+{
+	ablock_t *ab;
+	void *map;
+	int fd;
 
-	if (fclose(fp) != 0) return msg("Failed to close file \"%s\".", fn);
-	curbp->b_flags &= (modflag ? B_MODIFIED : ~B_MODIFIED);
-	msg("File \"%s\" %ld bytes read.", fn, len);
+	if (n <= 0 || MAX_SIZE_T < n || (fd = open(fn, O_RDONLY)) == -1) return (NULL);
+	map = mmap(NULL, (size_t) n, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return (NULL);
+	if ((ab = (ablock_t *) malloc(sizeof (ablock_t))) == NULL) {
+		munmap(map, (size_t) n);
+		return (NULL);
+	}
+	ab->a_text = (char_t *) map;
+	ab->a_size = ab->a_used = n;
+	ab->a_mapped = TRUE;
+	ab->a_next = bp->b_add;
+	bp->b_add = ab;
+	bp->b_flags |= B_MAPPED;
+	return (ab);
+}
+
+/* Add n chars of text to the piece table at offset, text must not move */
+int pinsert(buffer_t *bp, point_t offset, char_t *text, point_t n)
+{
+	piece_t *pp;
+	int i;
+
+	if (n <= 0) return (TRUE);
+
+	/* typing extends the previous piece when its text is adjacent */
+	if (0 < offset && (i = findpiece(bp, offset - 1)) < bp->b_npiece) {
+		pp = bp->b_piece + i;
+		if (pp->p_off + pp->p_len == offset && pp->p_text + pp->p_len == text) {
+			pp->p_len += n;
+			fixpieces(bp, i + 1);
+			return (TRUE);
+		}
+	}
+
+	if ((i = splitpiece(bp, offset)) < 0 || !growpieces(bp, 1)) return (FALSE);
+	pp = bp->b_piece + i;
+	memmove(pp + 1, pp, (bp->b_npiece - i) * sizeof (piece_t));
+	bp->b_npiece++;
+	pp->p_text = text;
+	pp->p_len = n;
+	fixpieces(bp, i);
 	return (TRUE);
 }
 
-char_t *get_key(keymap_t *keys, keymap_t **key_return)
+extern char_t *scan_nltab(char_t *, char_t *);
+extern char_t *scan_nlrev(char_t *, char_t *);
+extern long scan_nlcount(char_t *, char_t *);
+
+/* Count the newlines in n chars of s */
+point_t nlcount(char_t *s, point_t n)
 {
-	keymap_t *k;
-	int submatch;
-	static char_t buffer[K_BUFFER_LENGTH];
-	static char_t *record = buffer;
+	return (scan_nlcount(s, s + n));
+}
 
-	*key_return = NULL;
+/* Count the newlines in n chars of the buffer starting at offset */
+point_t count_nl(buffer_t *bp, point_t offset, point_t n)
+{
+	char_t *p;
+	point_t len, c = 0;
 
-	/* if recorded bytes remain, return next recorded byte. */
-	if (*record != '\0') {
-		*key_return = NULL;
-		return record++;
+	while (0 < n && (p = span(bp, offset, &len)) != NULL) {
+		if (n < len) len = n;
+		c += nlcount(p, len);
+		offset += len;
+		n -= len;
 	}
-	/* reset record buffer. */
-	record = buffer;
+	return (c);
+}
 
-	do {
-		assert(K_BUFFER_LENGTH > record - buffer);
-		/* read and record one byte. */
-		*record++ = (unsigned)getch();
-		*record = '\0';
+/* Offset of the k'th newline at or after offset, -1 if there is none */
+point_t find_nl(buffer_t *bp, point_t offset, point_t k)
+{
+	char_t *p, *q, *e;
+	point_t len;
+
+	for (; (p = span(bp, offset, &len)) != NULL; offset += len)
+		for (q = p, e = p + len; (q = memchr(q, '\n', e - q)) != NULL; ++q)
+			if (--k == 0)
+				return (offset + (q - p));
+	return (-1);
+}
 
-		/* if recorded bytes match any multi-byte sequence... */
-		for (k = keys, submatch = 0; k != NULL; k = k->k_next) {
-			char_t *p, *q;
+/* Fenwick trees are 1 based, f[i] sums a power of two run of values ending at i */
+void fen_add(point_t *f, int n, int i, point_t d)
+{
+	for (++i; i <= n; i += i & -i)
+		f[i] += d;
+}
 
-			if (k->k_func == NULL) continue;
-			assert(k->k_bytes != NULL);
+/* Sum of the first i values */
+point_t fen_sum(point_t *f, int i)
+{
+	point_t s = 0;
 
-			for (p = buffer, q = (char_t *)k->k_bytes; *p == *q; ++p, ++q) {
-			        /* an exact match */
-				if (*q == '\0' && *p == '\0') {
-	    				record = buffer;
-					*record = '\0';
-					*key_return = k;
-					return record; /* empty string */
-				}
-			}
-			/* record bytes match part of a command sequence */
-			if (*p == '\0' && *q != '\0') {
-				submatch = 1;
-			}
+	for (; 0 < i; i -= i & -i)
+		s += f[i];
+	return (s);
+}
+
+/* Number of leading values whose sum is below *t (or at, when !strict), *t gets the remainder */
+int fen_find(point_t *f, int n, point_t *t, int strict)
+{
+	int i = 0, step;
+
+	for (step = 1; step * 2 <= n; step *= 2)
+		;
+	for (; 0 < step; step /= 2) {
+		if (i + step <= n && (f[i+step] < *t || (!strict && f[i+step] == *t))) {
+			i += step;
+			*t -= f[i];
 		}
-	} while (submatch);
-	/* nothing matched, return recorded bytes. */
-	record = buffer;
-	return (record++);
+	}
+	return (i);
 }
 
-/* Reverse scan for start of logical line containing offset */
-point_t lnstart(buffer_t *bp, register point_t off)
+void fen_build(point_t *f, point_t *v, int n)
 {
-	register char_t *p;
-	do
-		p = ptr(bp, --off);
-	while (bp->b_buf < p && *p != '\n');
-	return (bp->b_buf < p ? ++off : 0);
+	int i, j;
+
+	for (i = 1; i <= n; i++)
+		f[i] = v[i-1];
+	for (i = 1; i <= n; i++)
+		if ((j = i + (i & -i)) <= n)
+			f[j] += f[i];
 }
 
-/* Forward scan for start of logical line segment containing 'finish' */
-point_t segstart(buffer_t *bp, point_t start, point_t finish)
+void drop_index(buffer_t *bp)
 {
-	char_t *p;
-	int c = 0;
-	point_t scan = start;
+	lindex_t *li = bp->b_lines;
+
+	if (li == NULL) return;
+	free(li->l_size);
+	free(li->l_nl);
+	free(li->l_fsize);
+	free(li->l_fnl);
+	free(li);
+	bp->b_lines = NULL;
+}
+
+/* Make room in the index for n blocks */
+int index_room(lindex_t *li, int n)
+{
+	point_t *a[4];
+	int i, m = li->l_mblock;
+
+	if (n <= m) return (TRUE);
+	while (m < n)
+		m = (m < 16 ? 16 : m * 2);
+	a[0] = realloc(li->l_size, m * sizeof (point_t));
+	if (a[0] != NULL) li->l_size = a[0];
+	a[1] = realloc(li->l_nl, m * sizeof (point_t));
+	if (a[1] != NULL) li->l_nl = a[1];
+	a[2] = realloc(li->l_fsize, (m + 1) * sizeof (point_t));
+	if (a[2] != NULL) li->l_fsize = a[2];
+	a[3] = realloc(li->l_fnl, (m + 1) * sizeof (point_t));
+	if (a[3] != NULL) li->l_fnl = a[3];
+	for (i = 0; i < 4; i++)
+		if (a[i] == NULL) return (FALSE);
+	li->l_mblock = m;
+	return (TRUE);
+}
+
+/* Split block b into blocks of LINE_BLOCK chars, counting their newlines afresh */
+int index_split(buffer_t *bp, int b)
+{
+	lindex_t *li = bp->b_lines;
+	point_t off = fen_sum(li->l_fsize, b);
+	point_t size = li->l_size[b];
+	int i, k = (size + LINE_BLOCK - 1) / LINE_BLOCK;
+
+	if (k == 0) k = 1;
+
+	if (!index_room(li, li->l_nblock + k - 1)) return (FALSE);
+	memmove(li->l_size + b + k, li->l_size + b + 1, (li->l_nblock - b - 1) * sizeof (point_t));
+	memmove(li->l_nl + b + k, li->l_nl + b + 1, (li->l_nblock - b - 1) * sizeof (point_t));
+	li->l_nblock += k - 1;
+	for (i = b; i < b + k; i++, off += LINE_BLOCK, size -= LINE_BLOCK) {
+		li->l_size[i] = (size < LINE_BLOCK ? size : LINE_BLOCK);
+		li->l_nl[i] = count_nl(bp, off, li->l_size[i]);
+	}
+	fen_build(li->l_fsize, li->l_size, li->l_nblock);
+	fen_build(li->l_fnl, li->l_nl, li->l_nblock);
+	return (TRUE);
+}
 
-	while (scan < finish) {
-		p = ptr(bp, scan);
-		if (*p == '\n') {
-			c = 0;
-			start = scan+1;
-		} else if (COLS <= c) {
-			c = 0;
-			start = scan;
+/* Return the newline index of a buffer, building it if need be */
+lindex_t *get_index(buffer_t *bp)
+{
+	lindex_t *li;
+
+	if (bp->b_lines != NULL) return (bp->b_lines);
+	if ((li = (lindex_t *) calloc(1, sizeof (lindex_t))) == NULL) return (NULL);
+	bp->b_lines = li;
+
+	/* one block holding the whole text, split into LINE_BLOCK sized blocks */
+	if (!index_room(li, 1)) {
+		drop_index(bp);
+		return (NULL);
+	}
+	li->l_nblock = 1;
+	li->l_size[0] = document_size(bp);
+	if (!index_split(bp, 0)) {
+		drop_index(bp);
+		return (NULL);
+	}
+	return (li);
+}
+
+/* Account for n chars of s having been inserted at offset */
+void index_insert(buffer_t *bp, point_t offset, char_t *s, point_t n)
+{
+	lindex_t *li = bp->b_lines;
+	point_t nl;
+	int b;
+
+	if (li == NULL) return;
+	b = fen_find(li->l_fsize, li->l_nblock, &offset, FALSE);
+	if (li->l_nblock <= b) b = li->l_nblock - 1;
+	nl = nlcount(s, n);
+	li->l_size[b] += n;
+	li->l_nl[b] += nl;
+	fen_add(li->l_fsize, li->l_nblock, b, n);
+	fen_add(li->l_fnl, li->l_nblock, b, nl);
+	if (2 * LINE_BLOCK < li->l_size[b] && !index_split(bp, b))
+		drop_index(bp);
+}
+
+/* Account for n chars at offset about to be deleted */
+void index_delete(buffer_t *bp, point_t offset, point_t n)
+{
+	lindex_t *li = bp->b_lines;
+	point_t t = offset, d, nl;
+	int b;
+
+	if (li == NULL) return;
+	b = fen_find(li->l_fsize, li->l_nblock, &t, FALSE);
+	for (; 0 < n && b < li->l_nblock; b++, t = 0) {
+		d = li->l_size[b] - t;
+		if (n < d) d = n;
+		nl = count_nl(bp, offset, d);
+		li->l_size[b] -= d;
+		li->l_nl[b] -= nl;
+		fen_add(li->l_fsize, li->l_nblock, b, -d);
+		fen_add(li->l_fnl, li->l_nblock, b, -nl);
+		offset += d;
+		n -= d;
+	}
+}
+
+point_t lnstart(buffer_t *, point_t);
+
+/* Return the offset of the start of a line, lines are numbered from 1 */
+point_t line_start(buffer_t *bp, point_t line)
+{
+	lindex_t *li = get_index(bp);
+	point_t k = line - 1, off;
+	int b;
+
+	if (k <= 0) return (0);
+	if (li == NULL) {
+		off = find_nl(bp, 0, k);
+	} else if (fen_sum(li->l_fnl, li->l_nblock) < k) {
+		off = -1;
+	} else {
+		b = fen_find(li->l_fnl, li->l_nblock, &k, TRUE);
+		off = find_nl(bp, fen_sum(li->l_fsize, b), k);
+	}
+	/* past the last line goes to the start of the last line */
+	return (off < 0 ? lnstart(bp, document_size(bp)) : off + 1);
+}
+
+/* Return the number of the line holding offset */
+point_t line_number(buffer_t *bp, point_t offset)
+{
+	lindex_t *li = get_index(bp);
+	point_t t = offset;
+	int b;
+
+	if (li == NULL) return (count_nl(bp, 0, offset) + 1);
+	b = fen_find(li->l_fsize, li->l_nblock, &t, FALSE);
+	return (fen_sum(li->l_fnl, b) + count_nl(bp, offset - t, t) + 1);
+}
+
+void copy_text(buffer_t *, point_t, point_t, char_t *);
+
+#define utext(u)        ((char_t *) ((u) + 1))
+
+/* bytes taken by a record of len chars, keeping the next one aligned */
+size_t usize(point_t len)
+{
+	return ((sizeof (undo_t) + len + sizeof (point_t) - 1) & ~(sizeof (point_t) - 1));
+}
+
+/* room for a record of len chars on top of the stack, NULL if out of memory */
+undo_t *upush(ustack_t *us, point_t len)
+{
+	ublock_t *ub = us->us_block;
+	size_t n = usize(len);
+	undo_t *u;
+
+	if (ub == NULL || ub->ub_size - ub->ub_used < n) {
+		size_t size = (n < UNDO_BLOCK ? UNDO_BLOCK : n);
+		if ((ub = (ublock_t *) malloc(sizeof (ublock_t) + size)) == NULL)
+			return (NULL);
+		ub->ub_prev = us->us_block;
+		ub->ub_size = size;
+		ub->ub_used = 0;
+		us->us_block = ub;
+	}
+	u = (undo_t *) ((char *) (ub + 1) + ub->ub_used);
+	ub->ub_used += n;
+	u->u_prev = us->us_top;
+	u->u_len = len;
+	us->us_top = u;
+	us->us_depth++;
+	return (u);
+}
+
+/* drop the top record, and its block once that is empty */
+void upop(ustack_t *us)
+{
+	ublock_t *ub = us->us_block;
+	undo_t *u = us->us_top;
+
+	us->us_top = u->u_prev;
+	us->us_depth--;
+	if ((ub->ub_used = (char *) u - (char *) (ub + 1)) == 0) {
+		us->us_block = ub->ub_prev;
+		free(ub);
+	}
+}
+
+/* add n chars to the top record if its block has room */
+int ugrow(ustack_t *us, point_t n)
+{
+	ublock_t *ub = us->us_block;
+	undo_t *u = us->us_top;
+	size_t used = (char *) u - (char *) (ub + 1) + usize(u->u_len + n);
+
+	if (ub->ub_size < used) return (FALSE);
+	ub->ub_used = used;
+	u->u_len += n;
+	return (TRUE);
+}
+
+void uclear(ustack_t *us)
+{
+	ublock_t *ub;
+
+	while ((ub = us->us_block) != NULL) {
+		us->us_block = ub->ub_prev;
+		free(ub);
+	}
+	us->us_top = NULL;
+	us->us_depth = 0;
+}
+
+/*
+ * Note an edit about to be made, the text is s for an insert and is
+ * still in the buffer for a delete.  An edit carrying on from the last
+ * one is added to its record, when made by the same command or when
+ * it is a single char typed straight after a command that made only
+ * that record.  The record on top when the buffer was saved is left as
+ * it is, so undo can find the saved text again.
+ */
+void undo_record(buffer_t *bp, int type, point_t off, point_t n, char_t *s)
+{
+	undo_t *u = bp->b_undo.us_top;
+	point_t len;
+
+	if (undoing) return;
+	/* the saved text was undone past and now cannot be redone */
+	if (bp->b_undo.us_depth < bp->b_usaved) bp->b_usaved = -1;
+	uclear(&bp->b_redo);
+
+	if (u != NULL && u->u_type == type && bp->b_undo.us_depth != bp->b_usaved &&
+	    (u->u_seq == undo_seq ||
+	    (n == 1 && u->u_len < UNDO_RUN && u->u_seq + 1 == undo_seq &&
+	    (u->u_prev == NULL || u->u_prev->u_seq != u->u_seq)))) {
+		len = u->u_len;
+		if (type == U_INSERT && off == u->u_off + len && ugrow(&bp->b_undo, n)) {
+			memcpy(utext(u) + len, s, n * sizeof (char_t));
+			u->u_seq = undo_seq;
+			return;
 		}
-		++scan;
-		c += *p == '\t' ? 8 - (c & 7) : 1;
+		if (type == U_DELETE && off == u->u_off && ugrow(&bp->b_undo, n)) {
+			copy_text(bp, off, n, utext(u) + len);
+			u->u_seq = undo_seq;
+			return;
+		}
+		if (type == U_DELETE && off + n == u->u_off && ugrow(&bp->b_undo, n)) {
+			memmove(utext(u) + n, utext(u), len * sizeof (char_t));
+			copy_text(bp, off, n, utext(u));
+			u->u_off = off;
+			u->u_seq = undo_seq;
+			return;
+		}
+	}
+
+	if ((u = upush(&bp->b_undo, n)) == NULL) {
+		/* a gap in the history would make undo wreck the text */
+		uclear(&bp->b_undo);
+		bp->b_usaved = -1;
+		msg("Out of memory, undo history lost");
+		return;
 	}
-	return (c < COLS ? start : finish);
+	u->u_type = type;
+	u->u_off = off;
+	u->u_seq = undo_seq;
+	if (type == U_INSERT)
+		memcpy(utext(u), s, n * sizeof (char_t));
+	else
+		copy_text(bp, off, n, utext(u));
 }
 
-/* Forward scan for start of logical line segment following 'finish' */
-point_t segnext(buffer_t *bp, point_t start, point_t finish)
+/* forget the wrap checkpoints an edit at off may have moved */
+void wrap_edit(buffer_t *bp, point_t off)
 {
-	char_t *p;
-	int c = 0;
+	wrap_t *w = &bp->b_wrap;
 
-	point_t scan = segstart(bp, start, finish);
-	for (;;) {
-		p = ptr(bp, scan);
-		if (bp->b_ebuf <= p || COLS <= c)
-			break;
-		++scan;
-		if (*p == '\n')
-			break;
-		c += *p == '\t' ? 8 - (c & 7) : 1;
+	if (w->w_line == NOMARK) return;
+	if (off < w->w_line) {
+		w->w_line = NOMARK;
+		return;
 	}
-	return (p < bp->b_ebuf ? scan : pos(bp, bp->b_ebuf));
+	/* a screen line start depends only on the text before it */
+	while (1 < w->w_n && off < w->w_ck[w->w_n - 1])
+		w->w_n--;
+	if (off < w->w_clear) w->w_clear = off;
 }
 
-/* Move up one screen line */
-point_t upup(buffer_t *bp, point_t off)
+/* widen the text changed since the last display to cover an edit at off */
+void dirty_text(buffer_t *bp, point_t off, point_t ins, point_t del)
 {
-	point_t curr = lnstart(bp, off);
-	point_t seg = segstart(bp, curr, off);
-	if (curr < seg)
-		off = segstart(bp, curr, seg-1);
+	if (bp->b_dlo == NOMARK) {
+		bp->b_dlo = off;
+		bp->b_dhi = off + ins;
+		return;
+	}
+	if (off < bp->b_dlo) bp->b_dlo = off;
+	if (bp->b_dhi <= off)
+		bp->b_dhi = off + ins;
 	else
-		off = segstart(bp, lnstart(bp,curr-1), curr-1);
-	return (off);
+		bp->b_dhi = (bp->b_dhi - del < off ? off : bp->b_dhi - del) + ins;
 }
 
-/* Move down one screen line */
-point_t dndn(buffer_t *bp, point_t off)
+/* Insert n chars at offset */
+int insert_text(buffer_t *bp, point_t offset, char_t *s, point_t n)
 {
-	return (segnext(bp, lnstart(bp,off), off));
+	ablock_t *ab = bp->b_add;
+
+	if (n <= 0) return (TRUE);
+
+	if (bp->b_flags & B_PIECE) {
+		if ((ab == NULL || ab->a_size - ab->a_used < n) && (ab = newblock(bp, n)) == NULL)
+			return (FALSE);
+		memcpy(ab->a_text + ab->a_used, s, n * sizeof (char_t));
+		ab->a_used += n;
+		if (!pinsert(bp, offset, ab->a_text + ab->a_used - n, n))
+			return (FALSE);
+	} else {
+		if (bp->b_egap - bp->b_gap < n && !growgap(bp, n))
+			return (FALSE);
+		(void) movegap(bp, offset);
+		memcpy(bp->b_gap, s, n * sizeof (char_t));
+		bp->b_gap += n;
+	}
+	index_insert(bp, offset, s, n);
+	undo_record(bp, U_INSERT, offset, n, s);
+	dirty_text(bp, offset, n, 0);
+	wrap_edit(bp, offset);
+	bp->b_edits++;
+	return (TRUE);
 }
 
-/* Return the offset of a column on the specified line */
-point_t lncolumn(buffer_t *bp, point_t offset, int column)
+/* Delete n chars at offset */
+int delete_text(buffer_t *bp, point_t offset, point_t n)
+{
+	point_t size = document_size(bp);
+	int i, j;
+
+	if (offset < 0 || size <= offset) return (FALSE);
+	if (size < offset + n) n = size - offset;
+	if (n <= 0) return (FALSE);
+
+	if (bp->b_flags & B_PIECE) {
+		if ((i = splitpiece(bp, offset)) < 0 || (j = splitpiece(bp, offset + n)) < 0)
+			return (FALSE);
+		undo_record(bp, U_DELETE, offset, n, NULL);
+		dirty_text(bp, offset, 0, n);
+		wrap_edit(bp, offset);
+		index_delete(bp, offset, n);
+		bp->b_edits++;
+		memmove(bp->b_piece + i, bp->b_piece + j, (bp->b_npiece - j) * sizeof (piece_t));
+		bp->b_npiece -= j - i;
+		fixpieces(bp, i);
+		return (TRUE);
+	}
+
+	undo_record(bp, U_DELETE, offset, n, NULL);
+	dirty_text(bp, offset, 0, n);
+	wrap_edit(bp, offset);
+	index_delete(bp, offset, n);
+	bp->b_edits++;
+	(void) movegap(bp, offset);
+	bp->b_egap += n;
+	/* do not hang on to the memory of a large cut */
+	if (2 * gap_cap < bp->b_egap - bp->b_gap)
+		shrinkgap(bp, gap_cap);
+	return (TRUE);
+}
+
+/* Copy n chars starting at offset to dst */
+void copy_text(buffer_t *bp, point_t offset, point_t n, char_t *dst)
 {
-	int c = 0;
 	char_t *p;
-	while ((p = ptr(bp, offset)) < bp->b_ebuf && *p != '\n' && c < column) {
-		c += *p == '\t' ? 8 - (c & 7) : 1;
-		++offset;
+	point_t len;
+
+	while (0 < n && (p = span(bp, offset, &len)) != NULL) {
+		if (n < len) len = n;
+		memcpy(dst, p, len * sizeof (char_t));
+		dst += len;
+		offset += len;
+		n -= len;
 	}
-	return (offset);
 }
 
-void modeline(buffer_t *bp)
+/*
+ * Undo the edits of the last command, or redo them, moving their records
+ * onto the other stack.  Records on the redo stack come off it oldest
+ * first, so replaying them in order repeats the edits as they were made.
+ */
+int undo_buffer(buffer_t *bp, int redo)
+{
+	ustack_t *from = (redo ? &bp->b_redo : &bp->b_undo);
+	ustack_t *to = (redo ? &bp->b_undo : &bp->b_redo);
+	unsigned long seq;
+	undo_t *u, *v;
+
+	if ((u = from->us_top) == NULL) return (FALSE);
+	seq = u->u_seq;
+	undoing = TRUE;
+	for (; u != NULL && u->u_seq == seq; upop(from), u = from->us_top) {
+		if ((v = upush(to, u->u_len)) != NULL) {
+			v->u_type = u->u_type;
+			v->u_off = u->u_off;
+			v->u_seq = u->u_seq;
+			memcpy(utext(v), utext(u), u->u_len * sizeof (char_t));
+		} else {
+			uclear(to);
+			bp->b_usaved = -1;
+		}
+		if ((u->u_type == U_INSERT) == redo) {
+			(void) insert_text(bp, u->u_off, utext(u), u->u_len);
+			bp->b_point = u->u_off + u->u_len;
+		} else {
+			(void) delete_text(bp, u->u_off, u->u_len);
+			bp->b_point = u->u_off;
+		}
+	}
+	undoing = FALSE;
+	bp->b_mark = NOMARK;
+	if (bp->b_undo.us_depth == bp->b_usaved)
+		bp->b_flags &= ~B_MODIFIED;
+	else
+		bp->b_flags |= B_MODIFIED;
+	return (TRUE);
+}
+
+/* write all of iov[0..n), going again after a short write */
+int writev_all(int fd, struct iovec *iov, int n)
 {
+	ssize_t w;
 	int i;
-	char mch;
-	
-	standout();
-	move(bp->w_top + bp->w_rows, 0);
-	mch = ((bp->b_flags & B_MODIFIED) ? '*' : '=');
-	sprintf(temp, "=%c " E_LABEL " == %s ", mch, bp->b_fname);
-	addstr(temp);
 
-	for (i = strlen(temp) + 1; i <= COLS; i++)
-		addch('=');
-	standend();
+	for (i = 0; i < n; ) {
+		if ((w = writev(fd, iov + i, n - i)) < 0) {
+			if (errno == EINTR) continue;
+			return (FALSE);
+		}
+		for (; i < n && iov[i].iov_len <= (size_t) w; i++)
+			w -= iov[i].iov_len;
+		if (i < n) {
+			iov[i].iov_base = (char *) iov[i].iov_base + w;
+			iov[i].iov_len -= w;
+		}
+	}
+	return (TRUE);
+}
+
+/* write the whole buffer to fd, a batch of spans to each writev() */
+int write_buffer(int fd, buffer_t *bp)
+{
+	struct iovec iov[SAVE_IOV];
+	point_t off = 0, len;
+	char_t *p;
+	int n;
+
+	for (;;) {
+		for (n = 0; n < SAVE_IOV && (p = span(bp, off, &len)) != NULL; n++, off += len) {
+			iov[n].iov_base = p;
+			iov[n].iov_len = (size_t) len;
+		}
+		if (n == 0) return (TRUE);
+		if (!writev_all(fd, iov, n)) return (FALSE);
+	}
+}
+
+/* flush a directory, so a file renamed into it survives a crash */
+void sync_dir(char *fname)
+{
+	char dname[PATH_MAX];
+	char *slash;
+	int fd;
+
+	(void)snprintf(dname, sizeof (dname), "%s", fname);
+	if ((slash = strrchr(dname, '/')) == NULL)
+		strcpy(dname, ".");
+	else
+		slash[slash == dname] = '\0';
+	if ((fd = open(dname, O_RDONLY)) != -1) {
+		(void)fsync(fd);
+		close(fd);
+	}
+}
+
+/* "dir/#name#" for "dir/name", FALSE if there is no file name */
+int autosave_name(char *fname, char *aname)
+{
+	char *base;
+
+	if (fname[0] == '\0') return (FALSE);
+	base = ((base = strrchr(fname, '/')) == NULL ? fname : base + 1);
+	(void)snprintf(aname, PATH_MAX, "%.*s#%s#", (int) (base - fname), fname, base);
+	return (TRUE);
+}
+
+/* write the snapshot out, then rename it into place so it is never half written */
+void *autosave_thread(void *arg)
+{
+	autosave_t *as = (autosave_t *) arg;
+	struct iovec iov[SAVE_IOV];
+	char tname[PATH_MAX + 8];
+	int fd, i, n, ok;
+
+	(void)snprintf(tname, sizeof (tname), "%s.XXXXXX", as->as_fname);
+	if ((ok = ((fd = mkstemp(tname)) != -1))) {
+		for (i = 0; ok && i < as->as_nseg; i += n) {
+			for (n = 0; n < SAVE_IOV && i + n < as->as_nseg; n++) {
+				iov[n].iov_base = as->as_seg[i + n].s_text;
+				iov[n].iov_len = (size_t) as->as_seg[i + n].s_len;
+			}
+			ok = writev_all(fd, iov, n);
+		}
+		ok = (ok && fsync(fd) == 0);
+		ok = (close(fd) == 0 && ok);
+		if (!(ok = (ok && rename(tname, as->as_fname) == 0)))
+			unlink(tname);
+	}
+	pthread_mutex_lock(&as_lock);
+	as->as_failed = !ok;
+	as->as_done = TRUE;
+	pthread_mutex_unlock(&as_lock);
+	return (NULL);
+}
+
+/* collect the autosave thread once it has finished, or wait for it */
+void autosave_reap(int wait)
+{
+	autosave_t *as = &autosave;
+	int done;
+
+	if (as->as_bp == NULL) return;
+	pthread_mutex_lock(&as_lock);
+	done = as->as_done;
+	pthread_mutex_unlock(&as_lock);
+	if (!done && !wait) return;
+
+	pthread_join(as->as_thread, NULL);
+	if (as->as_failed) msg("Failed to auto save \"%s\".", as->as_bp->b_fname);
+	free(as->as_seg);
+	free(as->as_copy);
+	as->as_bp = NULL;
+}
+
+/*
+ * Snapshot bp and write it out on a thread of its own.  Piece table
+ * text is never changed once added, so the snapshot can share it, but
+ * the gap moves under every edit so a gap buffer's text is copied.
+ */
+int autosave_start(buffer_t *bp)
+{
+	autosave_t *as = &autosave;
+	point_t off, len, size = document_size(bp);
+	seg_t *seg = NULL;
+	char_t *p;
+	int nseg = 0;
+
+	if (!autosave_name(bp->b_fname, as->as_fname)) return (FALSE);
+	as->as_copy = NULL;
+	if (!(bp->b_flags & B_PIECE) && 0 < size) {
+		if ((as->as_copy = (char_t *) malloc(size)) == NULL) return (FALSE);
+		copy_text(bp, 0, size, as->as_copy);
+		if ((seg = (seg_t *) malloc(sizeof (seg_t))) == NULL) {
+			free(as->as_copy);
+			return (FALSE);
+		}
+		seg->s_text = as->as_copy;
+		seg->s_off = 0;
+		seg->s_len = size;
+		nseg = 1;
+	}
+	for (off = 0; (bp->b_flags & B_PIECE) && (p = span(bp, off, &len)) != NULL; off += len, nseg++) {
+		if ((nseg & 63) == 0 && (seg = (seg_t *) realloc(seg, (nseg + 64) * sizeof (seg_t))) == NULL)
+			return (FALSE);
+		seg[nseg].s_text = p;
+		seg[nseg].s_off = off;
+		seg[nseg].s_len = len;
+	}
+
+	as->as_seg = seg;
+	as->as_nseg = nseg;
+	as->as_done = as->as_failed = FALSE;
+	as->as_bp = bp;
+	if (pthread_create(&as->as_thread, NULL, autosave_thread, as) != 0) {
+		free(seg);
+		free(as->as_copy);
+		as->as_bp = NULL;
+		return (FALSE);
+	}
+	bp->b_asedits = bp->b_edits;
+	return (TRUE);
+}
+
+/* after enough keys or time, autosave the first buffer changed since its last one */
+void autosave_check()
+{
+	buffer_t *bp;
+
+	autosave_reap(FALSE);
+	as_keys++;
+	if (autosave.as_bp != NULL || (as_keys < AUTOSAVE_KEYS && time(NULL) - as_time < AUTOSAVE_SECS))
+		return;
+	for (bp = bheadp; bp != NULL; bp = bp->b_next)
+		if ((bp->b_flags & B_MODIFIED) && bp->b_edits != bp->b_asedits && autosave_start(bp))
+			break;
+	as_keys = 0;
+	as_time = time(NULL);
+}
+
+/*
+ * Write a new copy of the file and rename it over the old one, so the
+ * file is never left half written, and a mapped file is never written
+ * while its pages are still in use.
+ */
+void save_buffer()
+{
+	char *fname = curbp->b_fname;
+	char real[PATH_MAX];
+	char tname[PATH_MAX + 8];
+	char aname[PATH_MAX];
+	struct timespec t0, t1;
+	struct stat sb;
+	mode_t mask;
+	double secs;
+	int fd, exists;
+
+	/* save through a symbolic link rather than replacing it */
+	if (lstat(fname, &sb) == 0 && S_ISLNK(sb.st_mode) && realpath(fname, real) != NULL)
+		fname = real;
+	exists = (stat(fname, &sb) == 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	(void)snprintf(tname, sizeof (tname), "%s.XXXXXX", fname);
+	if ((fd = mkstemp(tname)) == -1) {
+		msg("Failed to create file \"%s\".", tname);
+		return;
+	}
+	if (exists) {
+		(void)fchown(fd, sb.st_uid, sb.st_gid);
+		(void)fchmod(fd, sb.st_mode & 07777);
+	} else {
+		mask = umask(0);
+		(void)umask(mask);
+		(void)fchmod(fd, 0666 & ~mask);
+	}
+	if (!write_buffer(fd, curbp) || fsync(fd) != 0) {
+		msg("Failed to write file \"%s\".", curbp->b_fname);
+		close(fd);
+		unlink(tname);
+		return;
+	}
+	if (close(fd) != 0 || rename(tname, fname) != 0) {
+		msg("Failed to replace file \"%s\".", curbp->b_fname);
+		unlink(tname);
+		return;
+	}
+	sync_dir(fname);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	/* the auto save data is older than the file now */
+	if (autosave.as_bp == curbp) autosave_reap(TRUE);
+	if (autosave_name(curbp->b_fname, aname)) unlink(aname);
+
+	curbp->b_flags &= ~B_MODIFIED;
+	curbp->b_usaved = curbp->b_undo.us_depth;
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	msg("File \"%s\" %ld bytes saved, %.1f MB/s.", curbp->b_fname, document_size(curbp),
+		document_size(curbp) / (1024.0 * 1024.0) / (secs > 0 ? secs : 1e-9));
+}
+
+/* reads file into buffer at point */
+int insert_file(char *fn, int modflag)
+{
+	FILE *fp;
+	size_t len;
+	struct stat sb;
+	ablock_t *ab;
+
+	if (stat(fn, &sb) < 0) return msg("Failed to find file \"%s\".", fn);
+	if (MAX_SIZE_T < sb.st_size) msg("File \"%s\" is too big to load.", fn);
+	drop_index(curbp);
+	curbp->b_edits++;
+
+	if (curbp->b_flags & B_PIECE) {
+		if ((ab = mapblock(curbp, fn, sb.st_size)) != NULL) {
+			len = ab->a_size;
+		} else {
+			/* cannot map it, read it into an add block filled to capacity */
+			if ((ab = newblock(curbp, sb.st_size)) == NULL) return (FALSE);
+			ab->a_used = ab->a_size;
+			if ((fp = fopen(fn, "r")) == NULL) return msg("Failed to open file \"%s\".", fn);
+			len = fread(ab->a_text, sizeof (char), (size_t) sb.st_size, fp);
+			if (fclose(fp) != 0) return msg("Failed to close file \"%s\".", fn);
+		}
+		if (!pinsert(curbp, curbp->b_point, ab->a_text, len)) return (FALSE);
+	} else {
+		if (curbp->b_egap - curbp->b_gap < sb.st_size * sizeof (char_t) && !growgap(curbp, sb.st_size))
+			return (FALSE);
+		if ((fp = fopen(fn, "r")) == NULL) return msg("Failed to open file \"%s\".", fn);
+
+		curbp->b_point = movegap(curbp, curbp->b_point);
+		curbp->b_gap += len = fread(curbp->b_gap, sizeof (char), (size_t) sb.st_size, fp);
+		if (fclose(fp) != 0) return msg("Failed to close file \"%s\".", fn);
+	}
+
+	dirty_text(curbp, curbp->b_point, len, 0);
+	wrap_edit(curbp, curbp->b_point);
+	/* the read is not recorded for undo */
+	if (modflag) {
+		curbp->b_flags |= B_MODIFIED;
+		curbp->b_usaved = -1;
+	} else {
+		curbp->b_flags &= ~B_MODIFIED;
+		curbp->b_usaved = curbp->b_undo.us_depth;
+	}
+	msg("File \"%s\" %ld bytes read.", fn, len);
+	return (TRUE);
+}
+
+/* replace the text of the buffer with its auto save data */
+void recover_file()
+{
+	char aname[PATH_MAX];
+	struct stat sb;
+
+	if (!autosave_name(curbp->b_fname, aname) || stat(aname, &sb) != 0) {
+		msg("No auto save data for \"%s\".", curbp->b_bname);
+		return;
+	}
+	if (autosave.as_bp == curbp) autosave_reap(TRUE);
+	/* insert_file is not recorded for undo, so nothing before it can be undone */
+	undoing = TRUE;
+	(void)delete_text(curbp, 0, document_size(curbp));
+	undoing = FALSE;
+	uclear(&curbp->b_undo);
+	uclear(&curbp->b_redo);
+	curbp->b_point = curbp->b_page = 0;
+	curbp->b_mark = NOMARK;
+	(void)insert_file(aname, TRUE);
+}
+
+/* add a key to a trie, a key already there with the same bytes is kept */
+void key_insert(knode_t *n, keymap_t *kp)
+{
+	char_t *p = (char_t *)kp->k_bytes;
+	int c;
+
+	/* c-space is the one key whose byte is NUL */
+	do {
+		c = *p;
+		if (n->kn_next == NULL) {
+			n->kn_next = (knode_t **)calloc(256, sizeof(knode_t *));
+			assert(n->kn_next != NULL);
+		}
+		if (n->kn_next[c] == NULL) {
+			n->kn_next[c] = (knode_t *)calloc(1, sizeof(knode_t));
+			assert(n->kn_next[c] != NULL);
+		}
+		n = n->kn_next[c];
+	} while (*p != '\0' && *++p != '\0');
+	if (n->kn_key == NULL)
+		n->kn_key = kp;
+}
+
+knode_t *key_child(knode_t *n, char_t c)
+{
+	return (n != NULL && n->kn_next != NULL ? n->kn_next[c] : NULL);
+}
+
+/*
+ * The key bound to the n bytes at s in bp, its mode's keys before the
+ * global ones, NULL if none.  *more is set when the bytes begin a longer
+ * sequence.  The cost depends only on n, not on how many keys there are.
+ */
+keymap_t *key_match(buffer_t *bp, char_t *s, int n, int *more)
+{
+	knode_t *g = &ktrie, *m = (bp != NULL && bp->b_mode != NULL ? &bp->b_mode->km_trie : NULL);
+
+	for (; 0 < n && (g != NULL || m != NULL); s++, n--) {
+		g = key_child(g, *s);
+		m = key_child(m, *s);
+	}
+	*more = (n == 0 && ((g != NULL && g->kn_next != NULL) || (m != NULL && m->kn_next != NULL)));
+	if (n == 0 && m != NULL && m->kn_key != NULL) return (m->kn_key);
+	if (n == 0 && g != NULL && g->kn_key != NULL) return (g->kn_key);
+	return (NULL);
+}
+
+/* add a byte read from the keyboard to the macro being defined */
+int record_byte(int c)
+{
+	char_t *p;
+
+	if (kdefining) {
+		if (kmlen == kmmax) {
+			if ((p = (char_t *) realloc(kmacro, kmmax + 256)) == NULL) return (c);
+			kmacro = p;
+			kmmax += 256;
+		}
+		kmacro[kmlen++] = (char_t) c;
+	}
+	return (c);
+}
+
+long us_since(struct timespec *t0)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((t.tv_sec - t0->tv_sec) * 1000000L + (t.tv_nsec - t0->tv_nsec) / 1000);
+}
+
+/*
+ * A key byte from the terminal, or the trace being replayed, added to the
+ * trace being recorded.  When wait is FALSE it is -1 unless one is already
+ * waiting, and a replayed byte is only waiting if it was when recorded, so
+ * typed ahead chars are grouped the same way again.  The end of a replayed
+ * trace is a c-g that ends the session.
+ */
+int read_byte(int wait)
+{
+	struct timespec ts;
+	char w;
+	long d;
+	int c;
+
+	if (ktrace.t_in != NULL) {
+		if (!ktrace.t_have) {
+			if (fscanf(ktrace.t_in, "%ld %c %d", &ktrace.t_us, &w, &ktrace.t_c) != 3) {
+				done = 1;
+				return (wait ? 0x07 : -1);
+			}
+			ktrace.t_wait = (w == 'w');
+			ktrace.t_have = TRUE;
+		}
+		if (!wait && ktrace.t_wait) return (-1);
+		ktrace.t_have = FALSE;
+		if (!ktrace.t_fast && 0 < (d = ktrace.t_us - us_since(&ktrace.t_start))) {
+			ts.tv_sec = d / 1000000;
+			ts.tv_nsec = d % 1000000 * 1000;
+			(void) nanosleep(&ts, NULL);
+		}
+		return (ktrace.t_c);
+	}
+	if (!wait) nodelay(stdscr, TRUE);
+	c = getch();
+	if (!wait) nodelay(stdscr, FALSE);
+	if (!wait && c == ERR) return (-1);
+	if (ktrace.t_out != NULL)
+		fprintf(ktrace.t_out, "%ld %c %d\n", us_since(&ktrace.t_start), wait ? 'w' : 'n', c);
+	return (c);
+}
+
+/* the next key byte, from the keyboard macro when one is playing */
+int get_byte()
+{
+	int c;
+
+	if ((c = kback) != -1) {
+		kback = -1;
+		return (c);
+	}
+	if (kplay != NULL) {
+		if (kplay < kpend) return (*kplay++);
+		kplay = NULL;
+	}
+	if (batch) {
+		/* keys Lisp reads come from stdin, and end in a c-g */
+		c = getchar();
+		return (c == EOF ? 0x07 : c);
+	}
+	return (record_byte(read_byte(TRUE)));
+}
+
+/* the next key byte if one is already waiting, else -1 */
+int get_byte_now()
+{
+	int c;
+
+	if (kback != -1 || (kplay != NULL && kplay < kpend))
+		return (get_byte());
+	if (kplay != NULL || batch)
+		return (-1);
+	c = read_byte(FALSE);
+	return (c == -1 ? -1 : record_byte(c));
+}
+
+char_t *get_key(buffer_t *bp, keymap_t **key_return)
+{
+	keymap_t *k;
+	int submatch;
+	static char_t buffer[K_BUFFER_LENGTH];
+	static char_t *record = buffer;
+
+	*key_return = NULL;
+
+	/* if recorded bytes remain, return next recorded byte. */
+	if (*record != '\0') {
+		*key_return = NULL;
+		return record++;
+	}
+	/* reset record buffer. */
+	record = buffer;
+	/* a byte put back was added to the macro when it was first read */
+	kmstart = (kback != -1 && 0 < kmlen ? kmlen - 1 : kmlen);
+
+	do {
+		assert(K_BUFFER_LENGTH > record - buffer);
+		/* read and record one byte. */
+		*record++ = (unsigned)get_byte();
+
+		/* an exact match */
+		if ((k = key_match(bp, buffer, record - buffer, &submatch)) != NULL) {
+			record = buffer;
+			*record = '\0';
+			*key_return = k;
+			return record; /* empty string */
+		}
+		*record = '\0';
+		/* recorded bytes match part of a command sequence */
+	} while (submatch);
+	/* nothing matched, return recorded bytes. */
+	record = buffer;
+	return (record++);
+}
+
+/*
+ * The scanning functions below work a span of text at a time.  Only
+ * newlines and tabs need looking at one by one, scan_nltab() skips over
+ * the ordinary chars between them, which are one column each.
+ */
+
+/* Reverse scan for start of logical line containing offset */
+point_t lnstart(buffer_t *bp, register point_t off)
+{
+	char_t *p, *q;
+	point_t n;
+
+	for (; (p = rspan(bp, off, &n)) != NULL; off -= n)
+		if ((q = scan_nlrev(p, p + n)) != NULL)
+			return (off - n + (q - p) + 1);
+	return (0);
+}
+
+/* Forward scan for start of logical line segment containing 'finish' */
+point_t segstart(buffer_t *bp, point_t start, point_t finish)
+{
+	char_t *p, *q, *e;
+	point_t n, k, j, scan = start;
+	int c = 0, cols = (COLS < 1 ? 1 : COLS);
+
+	while (scan < finish && (p = span(bp, scan, &n)) != NULL) {
+		for (e = p + (finish - scan < n ? finish - scan : n); p < e; ++p, ++scan) {
+			if ((k = (q = scan_nltab(p, e)) - p) != 0) {
+				/* wraps fall at run index j, then every cols chars */
+				j = (cols <= c ? 0 : cols - c);
+				if (j < k) {
+					j += (k - 1 - j) / cols * cols;
+					start = scan + j;
+					c = k - j;
+				} else {
+					c += k;
+				}
+				scan += k;
+				if ((p = q) == e) break;
+			}
+			if (*p == '\n') {
+				c = 0;
+				start = scan+1;
+			} else if (cols <= c) {
+				c = 0;
+				start = scan;
+			}
+			c += *p == '\t' ? 8 - (c & 7) : 1;
+		}
+	}
+	return (c < cols ? start : finish);
+}
+
+/* Forward scan for start of logical line segment following 'finish' */
+point_t segnext(buffer_t *bp, point_t start, point_t finish)
+{
+	char_t *p, *q, *e;
+	point_t n;
+	int c = 0, cols = (COLS < 1 ? 1 : COLS);
+
+	point_t scan = segstart(bp, start, finish);
+	while (c < cols && (p = span(bp, scan, &n)) != NULL) {
+		/* look no further than the columns left, a long line has no end in sight */
+		e = p + (cols - c < n ? cols - c : n);
+		q = scan_nltab(p, e);
+		scan += q - p;
+		c += q - p;
+		if (q == e)
+			continue;
+		++scan;
+		if (*q == '\n')
+			break;
+		c += 8 - (c & 7);
+	}
+	return (scan);
+}
+
+/* TRUE if there is no newline in [from, to) */
+int no_nl(buffer_t *bp, point_t from, point_t to)
+{
+	char_t *p;
+	point_t n;
+
+	for (; from < to && (p = span(bp, from, &n)) != NULL; from += n)
+		if (memchr(p, '\n', (size_t) (to - from < n ? to - from : n)) != NULL)
+			return (FALSE);
+	return (TRUE);
+}
+
+/*
+ * Start of the screen line containing off.  A long line keeps the screen
+ * line starts found about every WRAP_GAP chars along it, so this only
+ * scans from the last of them before off, not from the start of the line.
+ */
+point_t seg_start(buffer_t *bp, point_t off)
+{
+	wrap_t *w = &bp->b_wrap;
+	point_t ls, *ck;
+	int lo, hi, mid;
+
+	if (w->w_line == NOMARK || w->w_cols != COLS || off < w->w_line ||
+	    (w->w_clear < off && !no_nl(bp, w->w_clear, off))) {
+		ls = lnstart(bp, off);
+		if (off - ls < WRAP_LONG) return (segstart(bp, ls, off));
+		if (w->w_m == 0 && (w->w_ck = (point_t *) malloc(64 * sizeof (point_t))) != NULL)
+			w->w_m = 64;
+		if (w->w_ck == NULL) return (segstart(bp, ls, off));
+		w->w_line = w->w_ck[0] = ls;
+		w->w_clear = off;
+		w->w_n = 1;
+		w->w_cols = COLS;
+	}
+	if (w->w_clear < off) w->w_clear = off;
+
+	while (w->w_ck[w->w_n - 1] + WRAP_GAP <= off) {
+		if (w->w_n == w->w_m) {
+			if ((ck = (point_t *) realloc(w->w_ck, 2 * w->w_m * sizeof (point_t))) == NULL)
+				break;
+			w->w_ck = ck;
+			w->w_m *= 2;
+		}
+		w->w_ck[w->w_n] = segstart(bp, w->w_ck[w->w_n - 1], w->w_ck[w->w_n - 1] + WRAP_GAP);
+		w->w_n++;
+	}
+
+	/* the last checkpoint at or before off */
+	for (lo = 0, hi = w->w_n - 1; lo < hi; ) {
+		mid = (lo + hi + 1) / 2;
+		if (w->w_ck[mid] <= off)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return (segstart(bp, w->w_ck[lo], off));
+}
+
+/* Move up one screen line */
+point_t upup(buffer_t *bp, point_t off)
+{
+	return (seg_start(bp, seg_start(bp, off) - 1));
+}
+
+/* Move down one screen line */
+point_t dndn(buffer_t *bp, point_t off)
+{
+	return (segnext(bp, seg_start(bp, off), off));
+}
+
+/* Return the offset of a column on the specified line */
+point_t lncolumn(buffer_t *bp, point_t offset, int column)
+{
+	int c = 0;
+	char_t *p, *q, *e;
+	point_t n;
+
+	while (c < column && (p = span(bp, offset, &n)) != NULL) {
+		e = p + (column - c < n ? column - c : n);
+		q = scan_nltab(p, e);
+		offset += q - p;
+		c += q - p;
+		if (q == e)
+			continue;
+		if (*q == '\n')
+			break;
+		c += 8 - (c & 7);
+		++offset;
+	}
+	return (offset);
+}
+
+/* values below HIST_SUB have buckets of their own, above it 16 share each power of two */
+int hist_bucket(long us)
+{
+	int e = 0, b;
+
+	if (us < HIST_SUB) return (us < 0 ? 0 : (int) us);
+	while (2 * HIST_SUB <= (us >> e))
+		e++;
+	b = HIST_SUB * (e + 1) + (int) (us >> e) - HIST_SUB;
+	return (b < HIST_BUCKETS ? b : HIST_BUCKETS - 1);
+}
+
+/* the highest value in bucket b */
+long hist_value(int b)
+{
+	int e;
+
+	if (b < HIST_SUB) return (b);
+	e = b / HIST_SUB - 1;
+	return ((((long) (b % HIST_SUB + HIST_SUB) + 1) << e) - 1);
+}
+
+void hist_add(hist_t *h, long us)
+{
+	int b = hist_bucket(us);
+
+	if (h->h_n == LAT_WINDOW)
+		h->h_count[h->h_ring[h->h_next]]--;
+	else
+		h->h_n++;
+	h->h_count[b]++;
+	h->h_ring[h->h_next] = (short) b;
+	h->h_next = (h->h_next + 1) % LAT_WINDOW;
+}
+
+/* the time that fraction q of the window took no longer than, 0 if empty */
+long hist_quantile(hist_t *h, double q)
+{
+	long want = (long) (q * h->h_n + 0.999999), seen = 0;
+	int b;
+
+	if (want < 1) want = 1;
+	for (b = 0; b < HIST_BUCKETS; b++)
+		if (want <= (seen += h->h_count[b]))
+			return (hist_value(b));
+	return (0);
+}
+
+/* record the time from t0 to t1 against a phase, returning it */
+long lat_note(int phase, struct timespec *t0, struct timespec *t1)
+{
+	long us = (t1->tv_sec - t0->tv_sec) * 1000000L + (t1->tv_nsec - t0->tv_nsec) / 1000;
+
+	hist_add(&lat[phase], us);
+	return (lat_last[phase] = us);
+}
+
+/* keys timed, then the 50th, 90th and 99th percentiles and the most, FALSE for no such phase */
+int latency(char *phase, long *stats)
+{
+	hist_t *h;
+	int i;
+
+	for (i = 0; i < LAT_PHASES && strcmp(phase, lat_name[i]) != 0; i++)
+		;
+	if (i == LAT_PHASES) return (FALSE);
+	h = &lat[i];
+	stats[0] = h->h_n;
+	stats[1] = hist_quantile(h, 0.50);
+	stats[2] = hist_quantile(h, 0.90);
+	stats[3] = hist_quantile(h, 0.99);
+	stats[4] = hist_quantile(h, 1.0);
+	return (TRUE);
+}
+
+/* the slowest command since the last reset, NULL if none has run */
+char *slowest_command(long *us)
+{
+	*us = lat_slowest;
+	return (lat_slowest < 0 ? NULL : lat_slowfn);
+}
+
+void latency_reset()
+{
+	memset(lat, 0, sizeof (lat));
+	lat_slowest = -1;
+}
+
+void set_show_latency(int on) { show_latency = on; }
+
+/* a time in microseconds, short enough for the modeline */
+char *fmt_us(long us, char *buf)
+{
+	if (us < 1000)
+		sprintf(buf, "%ldus", us);
+	else if (us < 1000000)
+		sprintf(buf, "%.1fms", us / 1e3);
+	else
+		sprintf(buf, "%.1fs", us / 1e6);
+	return (buf);
+}
+
+void modeline(buffer_t *bp)
+{
+	int i;
+	char mch;
+	
+	standout();
+	move(bp->w_top + bp->w_rows, 0);
+	mch = ((bp->b_flags & B_MODIFIED) ? '*' : '=');
+	sprintf(temp, "=%c " E_LABEL " == %s ", mch, bp->b_bname);
+	if (bp->b_mode != NULL)
+		sprintf(temp + strlen(temp), "(%s) ", bp->b_mode->km_name);
+	if (show_latency) {
+		char run[16], paint[16];
+		sprintf(temp + strlen(temp), "== run %s paint %s ", fmt_us(lat_last[LAT_RUN], run),
+			fmt_us(lat_last[LAT_PAINT], paint));
+	}
+	addstr(temp);
+
+	for (i = strlen(temp) + 1; i <= COLS; i++)
+		addch('=');
+	standend();
+}
+
+void dispmsg()
+{
+	move(MSGLINE, 0);
+	if (msgflag) {
+		addstr(msgline);
+		msgflag = FALSE;
+	}
+	clrtoeol();
+}
+
+/* have room in both frames for the rows of the window */
+void frame_alloc(int rows)
+{
+	int i;
+
+	if (rows <= frame[0].f_mrows) return;
+	for (i = 0; i < 2; i++) {
+		frame[i].f_start = (point_t *) realloc(frame[i].f_start, (rows + 1) * sizeof (point_t));
+		frame[i].f_col = (int *) realloc(frame[i].f_col, (rows + 1) * sizeof (int));
+		if (frame[i].f_start == NULL || frame[i].f_col == NULL)
+			fatal("Failed to allocate required memory.\n");
+		frame[i].f_mrows = rows;
+		frame[i].f_bp = NULL;
+	}
+	if ((fmatch = (int *) realloc(fmatch, (rows + 1) * sizeof (int))) == NULL)
+		fatal("Failed to allocate required memory.\n");
+}
+
+/*
+ * Lay out the screen row that starts at off in column *col, noting the
+ * cursor if point is on it.  When paint is set the row is expanded into
+ * lbuf, tabs as spaces and control chars as unctrl() shows them, and
+ * goes to the screen in one addnstr.  Returns where the next row starts,
+ * with *col set to the column it starts in, past any of a wide char that
+ * ran over the edge, or to -1 when the text ended in this row.
+ */
+point_t layout_row(buffer_t *bp, int row, int paint, point_t off, int *col)
+{
+	char_t *p, *e;
+	point_t n;
+	int j = *col, k, len = 0, ended = FALSE, nl = FALSE;
+	const char *ctrl;
+
+	while (!ended && (p = span(bp, off, &n)) != NULL) {
+		for (e = p + n; p < e && !ended; p++) {
+			if (off++ == bp->b_point) {
+				bp->b_row = row;
+				bp->b_col = j;
+			}
+			if (*p == '\r') {
+				/* takes no room */
+			} else if (*p == '\n') {
+				nl = TRUE;
+				j++;
+			} else if (*p == '\t') {
+				k = 8 - (j & 7);
+				if (paint) memset(lbuf + len, ' ', k);
+				len += k;
+				j += k;
+			} else if (isprint(*p)) {
+				if (paint) lbuf[len] = *p;
+				len++;
+				j++;
+			} else {
+				ctrl = unctrl(*p);
+				k = (int) strlen(ctrl);
+				if (paint) memcpy(lbuf + len, ctrl, k);
+				len += k;
+				j += k;
+			}
+			ended = (nl || COLS <= j);
+		}
+	}
+	if (!ended && off == bp->b_point) {
+		bp->b_row = row;
+		bp->b_col = j;
+	}
+	if (paint) {
+		mvaddnstr(row, *col, lbuf, len);
+		if (!ended || nl) clrtoeol();
+	}
+	*col = (!ended ? -1 : COLS < j ? j - COLS : 0);
+	return (off);
+}
+
+/*
+ * A row of the new frame can be left as it is on screen if a row of the
+ * last one showed the same text from the same column.  The rows before
+ * the text changed since then are where they were, those after it have
+ * moved by the change in size.
+ */
+int frame_match(frame_t *fo, frame_t *fn, int r, point_t lo, point_t hi)
+{
+	point_t s = fn->f_start[r], e = fn->f_start[r + 1], d;
+	int i;
+
+	if (lo == NOMARK || e <= lo)
+		d = 0;
+	else if (hi <= s)
+		d = fn->f_size - fo->f_size;
+	else
+		return (-1);
+	for (i = 0; i < fo->f_rows; i++)
+		if (fo->f_start[i] + d == s && fo->f_start[i + 1] + d == e && fo->f_col[i] == fn->f_col[r])
+			return (i);
+	return (-1);
+}
+
+/*
+ * The row of the last frame that starts at s in column col and that the
+ * text changed since then, [lo, hi), cannot have laid out differently,
+ * -1 if there is none.  Past the change s is shifted back by d, the
+ * change in size.  A row the text ended in is only kept with no change,
+ * as text added after it would carry on in it.
+ */
+int frame_keep(frame_t *fo, point_t s, int col, point_t lo, point_t hi, point_t d)
+{
+	int i = 0, j = fo->f_rows, k;
+
+	if (lo != NOMARK) {
+		if (hi <= s)
+			s -= d;
+		else if (lo <= s)
+			return (-1);
+	}
+	/* the first row starting at or after s, row starts never go down */
+	while (i < j) {
+		k = (i + j) / 2;
+		if (fo->f_start[k] < s)
+			i = k + 1;
+		else
+			j = k;
+	}
+	if (i == fo->f_rows || fo->f_start[i] != s || fo->f_col[i] != col || col < 0)
+		return (-1);
+	if (lo != NOMARK && (fo->f_col[i + 1] < 0 || (s < lo && lo < fo->f_start[i + 1])))
+		return (-1);
+	return (i);
+}
+
+/* move the window so that point is on it */
+void reframe(buffer_t *bp)
+{
+	point_t end = document_size(bp);
+	int i;
+
+	/* find start of screen, handle scroll up off page or top of file  */
+	/* point is always within b_page and b_epage */
+	if (bp->b_point < bp->b_page)
+		bp->b_page = seg_start(bp, bp->b_point);
+
+	/* reframe when scrolled off bottom */
+	if (bp->b_epage <= bp->b_point) {
+		/* Find end of screen plus one. */
+		bp->b_page = dndn(bp, bp->b_point);
+		/* if we scoll to EOF we show 1 blank line at bottom of screen */
+		if (end <= bp->b_page) {
+			bp->b_page = end;
+			i = bp->w_rows - 1;
+		} else {
+			i = bp->w_rows - 0;
+		}
+		/* Scan backwards the required number of lines. */
+		while (0 < i--)
+			bp->b_page = upup(bp, bp->b_page);
+	}
+}
+
+/*
+ * Find the row and column of point and the end of the window, as display()
+ * does, without painting anything.  Commands that move by rows use these,
+ * so while display is held they are found again before the first of them
+ * in each command.
+ */
+void place_cursor(buffer_t *bp)
+{
+	point_t off;
+	int r, col;
+
+	reframe(bp);
+	for (r = 0, off = bp->b_page, col = 0; r < bp->w_rows && 0 <= col; r++)
+		off = layout_row(bp, bp->w_top + r, FALSE, off, &col);
+	bp->b_epage = off;
+	placed = TRUE;
+}
+
+/* the window as the commands so far have left it, when display is held */
+void placed_cursor()
+{
+	if (hold_display && !placed) place_cursor(curbp);
+}
+
+/*
+ * Paint the window, only repainting the rows that show something
+ * different from the last frame.  Rows that have moved up or down are
+ * scrolled there by the terminal rather than painted again.
+ */
+void display()
+{
+	buffer_t *bp = curbp;
+	frame_t *fo = fold, *fn = (fold == frame ? frame + 1 : frame);
+	point_t end = document_size(bp), off, lo = bp->b_dlo, hi = bp->b_dhi;
+	int i, r, col, all, first, shift, rows = bp->w_rows, top = bp->w_top;
+
+	if (hold_display) return;
+	reframe(bp);
+
+	/* a row holds COLS columns, and at most a tab or control char more */
+	if (mlbuf < COLS + 8) {
+		if ((lbuf = (char *) realloc(lbuf, COLS + 8)) == NULL)
+			fatal("Failed to allocate required memory.\n");
+		mlbuf = COLS + 8;
+	}
+
+	/*
+	 * Lay out the new frame, painting it as it goes when none of the last
+	 * one can be kept.  Otherwise rows the last one laid out, and that the
+	 * text changed since cannot have moved, are taken from it as they are.
+	 */
+	frame_alloc(rows);
+	all = (fo->f_bp != bp || fo->f_rows != rows || fo->f_cols != COLS);
+	fn->f_bp = bp;
+	fn->f_rows = rows;
+	fn->f_cols = COLS;
+	fn->f_size = end;
+	for (r = 0, off = bp->b_page, col = 0; r < rows; r++) {
+		fn->f_start[r] = off;
+		fn->f_col[r] = col;
+		if (col < 0) {
+			if (!all) continue;
+			/* rows after the end of the text are blank */
+			move(top + r, 0);
+			clrtoeol();
+		} else if (!all && 0 <= (i = frame_keep(fo, off, col, lo, hi, end - fo->f_size))) {
+			off = fo->f_start[i + 1] + (lo != NOMARK && hi <= off ? end - fo->f_size : 0);
+			col = fo->f_col[i + 1];
+		} else {
+			off = layout_row(bp, top + r, all, off, &col);
+		}
+	}
+	fn->f_start[rows] = bp->b_epage = off;
+	fn->f_col[rows] = col;
+
+	/* a kept row was not laid out, so find the cursor in the row point is on */
+	for (r = rows - 1; 0 < r && (fn->f_col[r] < 0 || bp->b_point < fn->f_start[r]); r--)
+		;
+	col = fn->f_col[r];
+	if (!all && 0 <= col)
+		(void) layout_row(bp, top + r, FALSE, fn->f_start[r], &col);
+
+	for (r = 0; r < rows && !all; r++)
+		fmatch[r] = frame_match(fo, fn, r, lo, hi);
+
+	/* rows that moved all move the same way as the first, or are painted again */
+	for (first = 0; first < rows && !all && (fmatch[first] < 0 || fmatch[first] == first); first++)
+		;
+	if (first < rows && !all) {
+		shift = fmatch[first] - first;
+		for (r = 0; r < rows; r++)
+			if (0 <= fmatch[r] && (first <= r ? fmatch[r] - r != shift : first + shift <= r))
+				fmatch[r] = -1;
+		move(top + (shift < 0 ? first + shift : first), 0);
+		insdelln(-shift);
+	}
+
+	for (r = 0; r < rows && !all; r++) {
+		if (0 <= fmatch[r]) continue;
+		col = fn->f_col[r];
+		if (col < 0) {
+			move(top + r, 0);
+			clrtoeol();
+		} else {
+			(void) layout_row(bp, top + r, TRUE, fn->f_start[r], &col);
+		}
+	}
+	bp->b_dlo = NOMARK;
+	fold = fn;
+
+	modeline(bp);
+	dispmsg();
+	move(bp->b_row, bp->b_col); /* set cursor */
+	refresh();
+}
+
+void display_prompt_and_response(char *prompt, char *response)
+{
+	if (hold_display) return;
+	mvaddstr(MSGLINE, 0, prompt);
+	addstr(response);
+	clrtoeol();
+}
+
+void top() { curbp->b_point = 0; }
+void bottom() {	curbp->b_epage = curbp->b_point = document_size(curbp); }
+void left() { if (0 < curbp->b_point) --curbp->b_point; }
+void right() { if (curbp->b_point < document_size(curbp)) ++curbp->b_point; }
+void up() { placed_cursor(); curbp->b_point = lncolumn(curbp, upup(curbp, curbp->b_point),curbp->b_col); }
+void down() { placed_cursor(); curbp->b_point = lncolumn(curbp, dndn(curbp, curbp->b_point),curbp->b_col); }
+void lnbegin() { curbp->b_point = seg_start(curbp, curbp->b_point); }
+void quit() { done = 1; }
+/* paint the whole screen again, as when the terminal has been written over */
+void redraw()
+{
+	fold->f_bp = NULL;
+	clearok(curscr, TRUE);
+}
+
+void resize_terminal()
+{
+	buffer_t *bp;
+
+	for (bp = bheadp; bp != NULL; bp = bp->b_next)
+		bp->w_rows = LINES - 2;
+	fold->f_bp = NULL;   /* the screen has been cleared */
+}
+
+void lnend()
+{
+	curbp->b_point = dndn(curbp, curbp->b_point);
+	left();
+}
+
+void pgdown()
+{
+	placed_cursor();
+	curbp->b_page = curbp->b_point = upup(curbp, curbp->b_epage);
+	while (0 < curbp->b_row--)
+		down();
+	curbp->b_epage = document_size(curbp);
+}
+
+void pgup()
+{
+	int i = curbp->w_rows;
+	placed_cursor();
+	while (0 < --i) {
+		curbp->b_page = upup(curbp, curbp->b_page);
+		up();
+	}
+}
+
+/* chars that a key would insert, and do not begin any key sequence */
+int self_inserting(int c)
+{
+	char_t b = (char_t) c;
+	int more;
+
+	return ((31 < b || b == 10 || b == 9) && key_match(curbp, &b, 1, &more) == NULL && !more);
+}
+
+/*
+ * Insert the typed char and any more typed ahead after it that are waiting,
+ * with one insert_text(), so a paste into a terminal without bracketed
+ * paste is not inserted and painted a char at a time.
+ */
+void insert_run()
+{
+	char_t run[INSERT_RUN];
+	int c, n = 0;
+
+	run[n++] = (*input == '\r' ? '\n' : *input);
+	while (n < INSERT_RUN && (c = get_byte_now()) != -1) {
+		if (!self_inserting(c)) {
+			kback = c;
+			break;
+		}
+		run[n++] = (c == '\r' ? '\n' : c);
+	}
+	if (!insert_text(curbp, curbp->b_point, run, n)) return;
+	curbp->b_point += n;
+	curbp->b_flags |= B_MODIFIED;
+}
+
+/* text between the terminal's bracketed paste markers, inserted as one */
+void paste()
+{
+	static char_t end[] = "\x1B[201~";
+	char_t *p, *text = NULL;
+	point_t n = 0, m = 0;
+	int c, e = 0;
+
+	while (end[e] != '\0' && (c = get_byte()) != ERR) {
+		if (m <= n + e + 1) {
+			if ((p = (char_t *) realloc(text, m + CHUNK)) == NULL) break;
+			text = p;
+			m += CHUNK;
+		}
+		/* hold back bytes that may be the start of the end marker */
+		if (c == end[e]) {
+			e++;
+			continue;
+		}
+		memcpy(text + n, end, e);
+		n += e;
+		e = (c == end[0]);
+		if (!e) text[n++] = (c == '\r' ? '\n' : c);
+	}
+	if (0 < n && insert_text(curbp, curbp->b_point, text, n)) {
+		curbp->b_point += n;
+		curbp->b_flags |= B_MODIFIED;
+	}
+	free(text);
+}
+
+void backspace()
+{
+	if (0 < curbp->b_point && delete_text(curbp, curbp->b_point - 1, 1)) {
+		--curbp->b_point;
+		curbp->b_flags |= B_MODIFIED;
+	}
+}
+
+void delete()
+{
+	if (delete_text(curbp, curbp->b_point, 1))
+		curbp->b_flags |= B_MODIFIED;
+}
+
+void set_mark()
+{
+	curbp->b_mark = (curbp->b_mark == curbp->b_point ? NOMARK : curbp->b_point);
+	(curbp->b_mark != NOMARK) ? msg("Mark set") : msg("Mark cleared");
+}
+
+/* forget the oldest kill */
+void kill_drop()
+{
+	int old = (knew - nkill + 1 + KILL_RING) % KILL_RING;
+
+	kbytes -= klen[old];
+	free(kring[old]);
+	kring[old] = NULL;
+	nkill--;
+}
+
+/* forget the oldest kills while over the budget, the newest is always kept */
+void kill_trim()
+{
+	while (1 < nkill && kbudget < kbytes)
+		kill_drop();
+}
+
+/* add n chars of malloced, NUL terminated text to the ring, which keeps it */
+void kill_push(char_t *text, point_t n)
+{
+	if (nkill == KILL_RING) kill_drop();
+	knew = (knew + 1) % KILL_RING;
+	kring[knew] = text;
+	klen[knew] = n;
+	kbytes += n;
+	nkill++;
+	kill_trim();
+	ybp = NULL;   /* the ring has moved under any yank */
+}
+
+/* add a copy of n chars of s to the ring, FALSE if out of memory */
+int kill_new(char *s, point_t n)
+{
+	char_t *text;
+
+	if ((text = (char_t *) malloc(n + 1)) == NULL) return (FALSE);
+	memcpy(text, s, n * sizeof (char_t));
+	text[n] = '\0';
+	kill_push(text, n);
+	return (TRUE);
+}
+
+/* the nth most recent kill and its length, NULL if there are not that many */
+char *current_kill(int n, point_t *len)
+{
+	int i;
+
+	if (n < 0 || nkill <= n) return (NULL);
+	i = (knew - n + KILL_RING) % KILL_RING;
+	*len = klen[i];
+	return ((char *) kring[i]);
+}
+
+/* set the budget when n is not negative, and return it */
+point_t kill_ring_budget(point_t n)
+{
+	if (0 <= n) {
+		kbudget = n;
+		kill_trim();
+		ybp = NULL;
+	}
+	return (kbudget);
+}
+
+/* copy or cut the region to the kill ring, FALSE if nothing was pushed */
+int copy_cut(int cut, int verbose)
+{
+	point_t start, n;
+	char_t *text;
+
+	/* if no mark or point == marker, nothing doing */
+	if (curbp->b_mark == NOMARK || curbp->b_point == curbp->b_mark) return (FALSE);
+
+	if (curbp->b_point < curbp->b_mark) {
+		/* point above marker: region = marker - point */
+		start = curbp->b_point;
+		n = curbp->b_mark - curbp->b_point;
+	} else {
+		/* if point below marker: region = point - marker */
+		start = curbp->b_mark;
+		n = curbp->b_point - curbp->b_mark;
+	}
+	assert(n > 0);
+	if ((text = (char_t*) malloc(n + 1)) == NULL) {
+		msg("No more memory available.");
+		return (FALSE);
+	}
+	copy_text(curbp, start, n, text);
+	text[n] = '\0';  /* null terminate for eval_block */
+	kill_push(text, n);
+	if (cut) {
+		(void)delete_text(curbp, start, n);
+		curbp->b_point = start; /* set point to start of region */
+		curbp->b_flags |= B_MODIFIED;
+		if (verbose) msg("%ld bytes cut.", n);
+	} else {
+		if (verbose) msg("%ld bytes copied.", n);
+	}
+	curbp->b_mark = NOMARK;  /* unmark */
+	return (TRUE);
+}
+
+void insert_string(char *str)
+{
+	int len = (str == NULL) ? 0 : strlen(str);
+
+	if (len <= 0) {
+		msg("nothing to insert");
+	} else if (insert_text(curbp, curbp->b_point, (char_t *)str, len)) {
+		curbp->b_point += len;
+		curbp->b_flags |= B_MODIFIED;
+	}
+}
+
+/* insert kill kyank at point straight from the ring, noting where for yank_pop */
+void yank_text()
+{
+	point_t start = curbp->b_point;
+
+	if (!insert_text(curbp, start, kring[kyank], klen[kyank])) return;
+	curbp->b_point += klen[kyank];
+	curbp->b_flags |= B_MODIFIED;
+	ybp = curbp;
+	ystart = start;
+	yedits = curbp->b_edits;
+}
+
+void yank()
+{
+	if (nkill == 0) {
+		msg("Kill ring is empty");
+		return;
+	}
+	kyank = knew;
+	yank_text();
+}
+
+/* replace the text just yanked with the kill before it, going round the ring */
+void yank_pop()
+{
+	int age;
+
+	if (ybp != curbp || yedits != curbp->b_edits || nkill == 0) {
+		msg("Previous command was not a yank");
+		return;
+	}
+	(void)delete_text(curbp, ystart, klen[kyank]);
+	curbp->b_point = ystart;
+	age = ((knew - kyank + KILL_RING) % KILL_RING + 1) % nkill;
+	kyank = (knew - age + KILL_RING) % KILL_RING;
+	yank_text();
+}
+
+void undo()
+{
+	if (!undo_buffer(curbp, FALSE)) msg("No further undo information");
+}
+
+void redo()
+{
+	if (!undo_buffer(curbp, TRUE)) msg("No further redo information");
+}
+void copy_region() { (void)copy_cut(FALSE, TRUE); }
+void kill_region() { (void)copy_cut(TRUE, TRUE); }
+
+/* return char at current point */
+char *get_char()
+{
+	static char ch[2] = "\0\0";
+	ch[0] = (curbp->b_point < document_size(curbp) ? (char)*(ptr(curbp, curbp->b_point)) : '\0');
+	return ch;
+}
+
+/* wrapper to simplify call and dependancies in the interface code */
+char *get_input_key() {	return (char *)get_key(curbp, &key_return); }
+/* the name of the bound function of this key */
+char *get_key_funcname() { return (key_return != NULL ? key_return->k_funcname : ""); }
+/* the name of the last key */
+char *get_key_name() { return (key_return != NULL ? key_return->k_name : ""); }
+/* return point in current buffer */
+point_t get_point() { return curbp->b_point; }
+
+void set_point(point_t p)
+{
+	if (p < 0 || p > document_size(curbp)) return;
+	curbp->b_point = p;
+}
+
+extern void scan_skip(char_t *, long, long *);
+extern char_t *scan_find(char_t *, char_t *, char_t *, long, long *);
+
+/*
+ * Search each span of text with scan_find(), then look for a match
+ * straddling the end of the span in a small window copied from either
+ * side of the join.  Returns the offset just past the match, or -1.
+ */
+point_t search_forward(buffer_t *bp, point_t start_p, char *stext)
+{
+	point_t end_p = document_size(bp);
+	point_t m = strlen(stext), n, k, r, found = -1;
+	char_t *p, *q, *win;
+	long skip[256];
+
+	if (0 == m) return start_p;
+	if (start_p < 0) start_p = 0;
+	if ((win = (char_t *) malloc(2 * m)) == NULL) return -1;
+	scan_skip((char_t *) stext, m, skip);
+
+	for (; (p = span(bp, start_p, &n)) != NULL; start_p += n) {
+		if ((q = scan_find(p, p + n, (char_t *) stext, m, skip)) != NULL) {
+			found = start_p + (q - p) + m;
+			break;
+		}
+		/* a match starting in the last m-1 chars carries on into the next span */
+		k = (m - 1 < n ? m - 1 : n);
+		r = (m - 1 < end_p - start_p - n ? m - 1 : end_p - start_p - n);
+		if (0 < k && 0 < r) {
+			memcpy(win, p + n - k, k);
+			copy_text(bp, start_p + n, r, win + k);
+			if ((q = scan_find(win, win + k + r, (char_t *) stext, m, skip)) != NULL) {
+				found = start_p + n - k + (q - win) + m;
+				break;
+			}
+		}
+	}
+	free(win);
+	return found;
+}
+
+void goto_line(point_t line) { curbp->b_point = line_start(curbp, line); }
+
+/* line number of offset in current buffer, of point when offset is negative */
+point_t get_line_number(point_t offset)
+{
+	if (offset < 0 || document_size(curbp) < offset) offset = curbp->b_point;
+	return line_number(curbp, offset);
+}
+
+extern void scan_rskip(char_t *, long, long *);
+extern char_t *scan_rfind(char_t *, char_t *, char_t *, long, long *);
+
+/*
+ * Search backward from start_p for a match ending at or before it, a span
+ * at a time with scan_rfind().  A match straddling the start of the text
+ * already searched is later than any within the span, so that join is
+ * checked first.  Returns the offset of the start of the match, or -1.
+ */
+point_t search_backward(buffer_t *bp, point_t start_p, char *stext)
+{
+	point_t end_p, m = strlen(stext), n, k, r, found = -1;
+	char_t *p, *q, *win;
+	long skip[256];
+
+	if (document_size(bp) < start_p) start_p = document_size(bp);
+	if (0 == m || start_p < 0) return start_p;
+	if ((win = (char_t *) malloc(2 * m)) == NULL) return -1;
+	scan_rskip((char_t *) stext, m, skip);
+
+	for (end_p = start_p; (p = rspan(bp, start_p, &n)) != NULL; start_p -= n) {
+		k = (m - 1 < n ? m - 1 : n);
+		r = (m - 1 < end_p - start_p ? m - 1 : end_p - start_p);
+		if (0 < k && 0 < r) {
+			memcpy(win, p + n - k, k);
+			copy_text(bp, start_p, r, win + k);
+			if ((q = scan_rfind(win, win + k + r, (char_t *) stext, m, skip)) != NULL) {
+				found = start_p - k + (q - win);
+				break;
+			}
+		}
+		if ((q = scan_rfind(p, p + n, (char_t *) stext, m, skip)) != NULL) {
+			found = start_p - n + (q - p);
+			break;
+		}
+	}
+	free(win);
+	return found;
+}
+
+/* the last incremental search, to carry on from as the query grows */
+buffer_t *is_bp = NULL;
+unsigned long is_edits;
+point_t is_origin = -1;
+point_t is_match;             /* start of its match, -1 if it failed */
+int is_backward;
+char is_query[STRBUF_M];
+
+/*
+ * Search from origin as incremental search does, with the same result as
+ * search_forward() or search_backward().  When the query extends the
+ * last one from the same origin, every match of it is a match of the
+ * last query too, so the search starts from the last match, or fails at
+ * once if that search did; only a query that has shrunk is searched for
+ * from origin again.
+ */
+point_t isearch(buffer_t *bp, point_t origin, char *query, int backward)
+{
+	point_t m = strlen(query), from = origin, r;
+	size_t n = strlen(is_query);
+
+	if (bp == is_bp && bp->b_edits == is_edits && origin == is_origin &&
+	    backward == is_backward && n <= m && strncmp(query, is_query, n) == 0) {
+		if (is_match < 0) return -1;
+		from = (!backward ? is_match : (is_match + m < origin ? is_match + m : origin));
+	}
+
+	r = (backward ? search_backward(bp, from, query) : search_forward(bp, from, query));
+
+	is_bp = (m < STRBUF_M ? bp : NULL);
+	is_edits = bp->b_edits;
+	is_origin = origin;
+	is_backward = backward;
+	is_match = (r < 0 || backward ? r : r - m);
+	strncpy(is_query, query, STRBUF_M - 1);
+	return r;
+}
+
+/* Index of the segment holding offset, nseg if it is past the end */
+int seg_index(seg_t *seg, int nseg, point_t offset)
+{
+	int lo = 0, hi = nseg, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (offset < seg[mid].s_off)
+			hi = mid;
+		else if (seg[mid].s_off + seg[mid].s_len <= offset)
+			lo = mid + 1;
+		else
+			return (mid);
+	}
+	return (nseg);
+}
+
+void seg_copy(occur_t *o, point_t offset, point_t n, char_t *dst)
+{
+	int i = seg_index(o->o_seg, o->o_nseg, offset);
+	point_t k;
+
+	for (; 0 < n && i < o->o_nseg; i++, offset += k, dst += k, n -= k) {
+		k = o->o_seg[i].s_off + o->o_seg[i].s_len - offset;
+		if (n < k) k = n;
+		memcpy(dst, o->o_seg[i].s_text + (offset - o->o_seg[i].s_off), k);
+	}
+}
+
+/* The first match starting in [from, limit), -1 if none, as search_forward() but over segments */
+point_t seg_find(occur_t *o, point_t from, point_t limit)
+{
+	point_t m = o->o_m, start, end, j, k, r;
+	seg_t *sp;
+	char_t *q;
+	int i;
+
+	for (i = seg_index(o->o_seg, o->o_nseg, from); i < o->o_nseg && o->o_seg[i].s_off < limit; i++) {
+		sp = o->o_seg + i;
+		start = (from < sp->s_off ? sp->s_off : from);
+		end = sp->s_off + sp->s_len;
+		if (limit + m - 1 < end) end = limit + m - 1;
+		if (m <= end - start && (q = scan_find(sp->s_text + (start - sp->s_off),
+		    sp->s_text + (end - sp->s_off), o->o_s, m, o->o_skip)) != NULL)
+			return (sp->s_off + (q - sp->s_text));
+
+		j = sp->s_off + sp->s_len;
+		k = (m - 1 < j - start ? m - 1 : j - start);
+		r = (m - 1 < o->o_size - j ? m - 1 : o->o_size - j);
+		if (0 < k && 0 < r) {
+			seg_copy(o, j - k, k + r, o->o_win);
+			if ((q = scan_find(o->o_win, o->o_win + k + r, o->o_s, m, o->o_skip)) != NULL && j - k + (q - o->o_win) < limit)
+				return (j - k + (q - o->o_win));
+		}
+	}
+	return (-1);
 }
 
-void dispmsg()
+int occur_add(occur_t *o, point_t s, int all)
 {
-	move(MSGLINE, 0);
-	if (msgflag) {
-		addstr(msgline);
-		msgflag = FALSE;
+	point_t *new;
+
+	if (all || o->o_nmatch < OCCUR_SYNC) {
+		if (o->o_nmatch == o->o_mmatch) {
+			o->o_mmatch = (o->o_mmatch == 0 ? OCCUR_SYNC : 2 * o->o_mmatch);
+			if ((new = (point_t *) realloc(o->o_match, o->o_mmatch * sizeof (point_t))) == NULL)
+				return (FALSE);
+			o->o_match = new;
+		}
+		o->o_match[o->o_nmatch++] = s;
 	}
-	clrtoeol();
+	return (TRUE);
 }
 
-void display()
+/* Find the matches in a chunk as if one could start at its first char */
+void *occur_thread(void *arg)
 {
-	char_t *p;
-	int i, j, k;
-	buffer_t *bp = curbp;
-	
-	/* find start of screen, handle scroll up off page or top of file  */
-	/* point is always within b_page and b_epage */
-	if (bp->b_point < bp->b_page)
-		bp->b_page = segstart(bp, lnstart(bp,bp->b_point), bp->b_point);
+	occur_t *o = (occur_t *) arg;
+	point_t s, pos = o->o_lo;
 
-	/* reframe when scrolled off bottom */
-	if (bp->b_epage <= bp->b_point) {
-		/* Find end of screen plus one. */
-		bp->b_page = dndn(bp, bp->b_point);
-		/* if we scoll to EOF we show 1 blank line at bottom of screen */
-		if (pos(bp, bp->b_ebuf) <= bp->b_page) {
-			bp->b_page = pos(bp, bp->b_ebuf);
-			i = bp->w_rows - 1;
-		} else {
-			i = bp->w_rows - 0;
+	while ((s = seg_find(o, pos, o->o_hi)) >= 0) {
+		if (!occur_add(o, s, o->o_all)) {
+			o->o_failed = TRUE;
+			break;
 		}
-		/* Scan backwards the required number of lines. */
-		while (0 < i--)
-			bp->b_page = upup(bp, bp->b_page);
+		o->o_count++;
+		o->o_end = pos = s + o->o_m;
 	}
+	return (NULL);
+}
 
-	move(bp->w_top, 0); /* start from top of window */
-	i = bp->w_top;
-	j = 0;
-	bp->b_epage = bp->b_page;
-	
-	/* paint screen from top of page until we hit maxline */ 
-	while (1) {
-		/* reached point - store the cursor position */
-		if (bp->b_point == bp->b_epage) {
-			bp->b_row = i;
-			bp->b_col = j;
-		}
-		p = ptr(bp, bp->b_epage);
-		if (bp->w_top + bp->w_rows <= i || bp->b_ebuf <= p) /* maxline */
-			break;
-		if (*p != '\r') {
-			if (isprint(*p) || *p == '\t' || *p == '\n') {
-				j += *p == '\t' ? 8-(j&7) : 1;
-				addch(*p);
-			} else {
-				const char *ctrl = unctrl(*p);
-				j += (int) strlen(ctrl);
-				addstr(ctrl);
+/*
+ * Count the matches of stext, not overlapping, as a loop of search_forward()s
+ * would, with a thread searching each chunk of a large buffer.  A thread
+ * does not know where the last match in the chunk before it ends, so the
+ * chunks are stitched together afterwards: where that match runs into a
+ * chunk, its start is searched again until the matches line up with those
+ * the thread found.  The starts of the matches are returned in a new array
+ * in *offsets if it is not NULL.  Returns the count, -1 if out of memory.
+ */
+point_t occur(buffer_t *bp, char *stext, point_t **offsets)
+{
+	occur_t occ[OCCUR_THREADS], res, *o;
+	pthread_t tid[OCCUR_THREADS];
+	int started[OCCUR_THREADS];
+	point_t size = document_size(bp), m = strlen(stext);
+	point_t total = 0, prev = 0, pos, s, n, k;
+	seg_t *seg = NULL;
+	long skip[256], ncpu;
+	char_t *p;
+	int i, nt, nseg = 0, synced, failed = FALSE;
+
+	if (offsets != NULL) *offsets = NULL;
+	if (m == 0 || size < m) return (0);
+
+	for (pos = 0; (p = span(bp, pos, &n)) != NULL; pos += n, nseg++) {
+		if ((nseg & 63) == 0 && (seg = (seg_t *) realloc(seg, (nseg + 64) * sizeof (seg_t))) == NULL)
+			return (-1);
+		seg[nseg].s_text = p;
+		seg[nseg].s_off = pos;
+		seg[nseg].s_len = n;
+	}
+	scan_skip((char_t *) stext, m, skip);
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nt = (int) (size / OCCUR_CHUNK);
+	if (ncpu < nt) nt = (int) ncpu;
+	if (OCCUR_THREADS < nt) nt = OCCUR_THREADS;
+	if (nt < 1) nt = 1;
+
+	for (i = 0; i < nt; i++) {
+		o = occ + i;
+		memset(o, 0, sizeof (occur_t));
+		o->o_seg = seg;
+		o->o_nseg = nseg;
+		o->o_size = size;
+		o->o_s = (char_t *) stext;
+		o->o_m = m;
+		o->o_skip = skip;
+		o->o_all = (offsets != NULL);
+		o->o_lo = size / nt * i;
+		o->o_hi = (i == nt - 1 ? size : size / nt * (i + 1));
+		if ((o->o_win = (char_t *) malloc(2 * m)) == NULL) failed = TRUE;
+	}
+	/* the first chunk is searched here, by this thread */
+	for (i = 1; i < nt && !failed; i++)
+		if (!(started[i] = (pthread_create(tid + i, NULL, occur_thread, occ + i) == 0)))
+			occur_thread(occ + i);
+	if (!failed) occur_thread(occ);
+	/* a chunk whose thread could not start was searched above */
+	for (i = 1; i < nt && !failed; i++)
+		if (started[i]) pthread_join(tid[i], NULL);
+
+	memset(&res, 0, sizeof (occur_t));
+	for (i = 0; i < nt && !failed; i++) {
+		o = occ + i;
+		if ((failed = o->o_failed)) break;
+		k = 0;
+		synced = TRUE;
+		if (0 < o->o_count && o->o_match[0] < prev) {
+			/* the last match of the chunk before runs into this one */
+			for (synced = FALSE, pos = prev; (s = seg_find(o, pos, o->o_hi)) >= 0; pos = prev = s + m) {
+				while (k < o->o_nmatch && o->o_match[k] < s) k++;
+				if (k < o->o_nmatch && o->o_match[k] == s) {
+					synced = TRUE;
+					break;
+				}
+				total++;
+				if (o->o_all && !occur_add(&res, s, TRUE)) failed = TRUE;
 			}
 		}
-		if (*p == '\n' || COLS <= j) {
-			j -= COLS;
-			if (j < 0)
-				j = 0;
-			++i;
-		}
-		++bp->b_epage;
+		if (!synced) continue;
+		total += o->o_count - k;
+		if (0 < o->o_count) prev = o->o_end;
+		for (; o->o_all && k < o->o_nmatch; k++)
+			if (!occur_add(&res, o->o_match[k], TRUE)) failed = TRUE;
 	}
 
-	/* replacement for clrtobot() to bottom of window */
-	for (k=i; k < bp->w_top + bp->w_rows; k++) {
-		move(k, j); /* clear from very last char not start of line */
-		clrtoeol();
-		j = 0; /* thereafter start of line */
+	for (i = 0; i < nt; i++) {
+		free(occ[i].o_win);
+		free(occ[i].o_match);
 	}
-
-	modeline(bp);
-	dispmsg();
-	move(bp->b_row, bp->b_col); /* set cursor */
-	refresh();
+	free(seg);
+	if (failed) {
+		free(res.o_match);
+		return (-1);
+	}
+	if (offsets != NULL) *offsets = res.o_match;
+	return (total);
 }
 
-void display_prompt_and_response(char *prompt, char *response)
+/* The lines holding matches of stext, as "line: text" in a new string, NULL if out of memory */
+char *occur_lines(buffer_t *bp, char *stext, point_t *count)
 {
-	mvaddstr(MSGLINE, 0, prompt);
-	addstr(response);
-	clrtoeol();
+	point_t *offs, n, i, ls, le, k, line = 1, last = 0, len = 0, max = 0;
+	char *out = NULL, *new;
+
+	if ((n = occur(bp, stext, &offs)) < 0) return (NULL);
+	*count = n;
+	for (i = 0; i < n; i++) {
+		if ((ls = lnstart(bp, offs[i])) < last) continue;
+		line += count_nl(bp, last, ls - last);
+		if ((le = find_nl(bp, offs[i], 1)) < 0) le = document_size(bp);
+		if (max < len + (le - ls) + 32) {
+			max = 2 * (len + (le - ls) + 32);
+			if ((new = (char *) realloc(out, max)) == NULL) break;
+			out = new;
+		}
+		k = sprintf(out + len, "%ld: ", line);
+		copy_text(bp, ls, le - ls, (char_t *) out + len + k);
+		len += k + (le - ls);
+		out[len++] = '\n';
+		/* the next match on a later line starts the count from here */
+		line += 1;
+		last = le + 1;
+	}
+	free(offs);
+	if (i < n) {
+		free(out);
+		return (NULL);
+	}
+	if (out == NULL && (out = (char *) malloc(1)) == NULL) return (NULL);
+	out[len] = '\0';
+	return (out);
 }
 
-void top() { curbp->b_point = 0; }
-void bottom() {	curbp->b_epage = curbp->b_point = pos(curbp, curbp->b_ebuf); }
-void left() { if (0 < curbp->b_point) --curbp->b_point; }
-void right() { if (curbp->b_point < pos(curbp, curbp->b_ebuf)) ++curbp->b_point; }
-void up() { curbp->b_point = lncolumn(curbp, upup(curbp, curbp->b_point),curbp->b_col); }
-void down() { curbp->b_point = lncolumn(curbp, dndn(curbp, curbp->b_point),curbp->b_col); }
-void lnbegin() { curbp->b_point = segstart(curbp, lnstart(curbp,curbp->b_point), curbp->b_point); }
-void quit() { done = 1; }
-void resize_terminal() { curbp->w_rows = LINES - 2; }
+point_t count_matches_curbp(char *stext) { return occur(curbp, stext, NULL); }
 
-void lnend()
+/* starts of the matches in a new array, their number in *n */
+point_t *occur_offsets_curbp(char *stext, point_t *n)
 {
-	curbp->b_point = dndn(curbp, curbp->b_point);
-	left();
+	point_t *offs;
+
+	*n = occur(curbp, stext, &offs);
+	return (*n < 0 ? NULL : offs);
 }
 
-void pgdown()
-{
-	curbp->b_page = curbp->b_point = upup(curbp, curbp->b_epage);
-	while (0 < curbp->b_row--)
-		down();
-	curbp->b_epage = pos(curbp, curbp->b_ebuf);
+char *occur_curbp(char *stext, point_t *count) { return occur_lines(curbp, stext, count); }
+
+point_t search_forward_curbp(point_t start_p, char *stext) {
+	return search_forward(curbp, start_p, stext);
 }
 
-void pgup()
+point_t search_backward_curbp(point_t start_p, char *stext) {
+	return search_backward(curbp, start_p, stext);
+}
+
+point_t isearch_curbp(point_t origin, char *query, int backward) {
+	return isearch(curbp, origin, query, backward);
+}
+
+/* the text regex.c searches */
+char_t *span_curbp(point_t offset, point_t *n) { return span(curbp, offset, n); }
+char_t *rspan_curbp(point_t offset, point_t *n) { return rspan(curbp, offset, n); }
+point_t size_curbp(void) { return document_size(curbp); }
+
+typedef struct rx_t rx_t;
+extern rx_t *rx_compile(char *, char **);
+extern void rx_free(rx_t *);
+extern point_t rx_search(rx_t *, point_t, point_t *);
+extern point_t rx_search_back(rx_t *, point_t, point_t *);
+extern int rx_ngroup(rx_t *);
+
+#define NMATCH 10             /* RX_NGROUP in regex.c */
+
+rx_t *re_last = NULL;         /* last pattern compiled, kept for its DFA cache */
+char *re_pattern = NULL;
+int re_ngroup = 0;
+point_t re_match[2 * NMATCH]; /* start and end of each group of the last match */
+
+/*
+ * Search for a regular expression, returning the offset just past the
+ * match going forward, or the start of the match going backward, -1 if
+ * there is none.  *err is set if the pattern is not valid.
+ */
+point_t re_search_curbp(point_t start_p, char *pattern, int backward, char **err)
 {
-	int i = curbp->w_rows;
-	while (0 < --i) {
-		curbp->b_page = upup(curbp, curbp->b_page);
-		up();
+	point_t caps[2 * NMATCH];
+	rx_t *rx;
+	char *copy;
+	int i;
+
+	*err = NULL;
+	if (re_pattern == NULL || strcmp(re_pattern, pattern) != 0) {
+		if ((rx = rx_compile(pattern, err)) == NULL) return -1;
+		if ((copy = strdup(pattern)) == NULL) {
+			rx_free(rx);
+			*err = "out of memory";
+			return -1;
+		}
+		rx_free(re_last);
+		free(re_pattern);
+		re_last = rx;
+		re_pattern = copy;
 	}
+	if ((backward ? rx_search_back(re_last, start_p, caps) : rx_search(re_last, start_p, caps)) < 0)
+		return -1;
+	re_ngroup = rx_ngroup(re_last);
+	for (i = 0; i < 2 * NMATCH; i++)
+		re_match[i] = (i < 2 * re_ngroup ? caps[i] : -1);
+	return (backward ? re_match[0] : re_match[1]);
 }
 
-void insert()
+/* start (or end) of group n of the last match, -1 if it did not take part */
+point_t match_pos(int n, int end)
 {
-	assert(curbp->b_gap <= curbp->b_egap);
-	if (curbp->b_gap == curbp->b_egap && !growgap(curbp, CHUNK)) return;
-	curbp->b_point = movegap(curbp, curbp->b_point);
-	*curbp->b_gap++ = *input == '\r' ? '\n' : *input;
-	curbp->b_point = pos(curbp, curbp->b_egap);
-	curbp->b_flags |= B_MODIFIED;
+	if (n < 0 || re_ngroup <= n) return -1;
+	return re_match[2 * n + (end ? 1 : 0)];
 }
 
-void backspace()
+/* text of group n of the last match in a new string, NULL if there is none */
+char *match_string(int n, point_t *len)
 {
-	curbp->b_point = movegap(curbp, curbp->b_point);
-	if (curbp->b_buf < curbp->b_gap) {
-		--curbp->b_gap;
-		curbp->b_flags |= B_MODIFIED;
-	}
-	curbp->b_point = pos(curbp, curbp->b_egap);
+	point_t s = match_pos(n, 0), e = match_pos(n, 1);
+	char *str;
+
+	if (s < 0 || e < s || document_size(curbp) < e) return NULL;
+	if ((str = (char *) malloc(e - s + 1)) == NULL) return NULL;
+	copy_text(curbp, s, e - s, (char_t *) str);
+	str[e - s] = '\0';
+	*len = e - s;
+	return str;
 }
 
-void delete()
+/* Find a buffer by name, making a new one at the end of the list if cflag and there is none */
+buffer_t *find_buffer(char *bname, int cflag)
 {
-	curbp->b_point = movegap(curbp, curbp->b_point);
-	if (curbp->b_egap < curbp->b_ebuf) {
-		curbp->b_point = pos(curbp, ++curbp->b_egap);
-		curbp->b_flags |= B_MODIFIED;
-	}
+	buffer_t *bp, *last = NULL;
+
+	for (bp = bheadp; bp != NULL; last = bp, bp = bp->b_next)
+		if (strncmp(bname, bp->b_bname, MAX_BNAME) == 0)
+			return (bp);
+	if (!cflag) return (NULL);
+
+	bp = new_buffer();
+	strncpy(bp->b_bname, bname, MAX_BNAME);
+	bp->b_bname[MAX_BNAME] = '\0';
+	if (last == NULL)
+		bheadp = bp;
+	else
+		last->b_next = bp;
+	return (bp);
 }
 
-void set_mark()
+/* A buffer for a file, named after it, its text is not read until it is first shown */
+buffer_t *file_buffer(char *fn)
 {
-	curbp->b_mark = (curbp->b_mark == curbp->b_point ? NOMARK : curbp->b_point);
-	(curbp->b_mark != NOMARK) ? msg("Mark set") : msg("Mark cleared");
+	buffer_t *bp;
+	char bname[MAX_BNAME + 1], *base;
+	int i;
+
+	for (bp = bheadp; bp != NULL; bp = bp->b_next)
+		if (strncmp(fn, bp->b_fname, MAX_FNAME) == 0)
+			return (bp);
+
+	base = ((base = strrchr(fn, '/')) == NULL || base[1] == '\0' ? fn : base + 1);
+	strncpy(bname, base, MAX_BNAME);
+	bname[MAX_BNAME] = '\0';
+	for (i = 2; find_buffer(bname, FALSE) != NULL; i++)
+		snprintf(bname, sizeof (bname), "%.*s<%d>", MAX_BNAME - 12, base, i);
+
+	bp = find_buffer(bname, TRUE);
+	strncpy(bp->b_fname, fn, MAX_FNAME);
+	bp->b_fname[MAX_FNAME] = '\0';
+	bp->b_flags |= B_LOAD;
+	return (bp);
 }
 
-void copy_cut(int cut, int verbose)
+/* Read in the file of a buffer that has not been shown yet */
+void load_buffer(buffer_t *bp)
 {
-	char_t *p;
-	if (scrap != NULL) {
-		free(scrap);
-		scrap = NULL;
-		nscrap = 0;
-	}
-	/* if no mark or point == marker, nothing doing */
-	if (curbp->b_mark == NOMARK || curbp->b_point == curbp->b_mark) return;
+	buffer_t *old = curbp;
+	char aname[PATH_MAX];
+	struct stat sb, asb;
+	int exists;
+
+	if (!(bp->b_flags & B_LOAD)) return;
+	bp->b_flags &= ~B_LOAD;
+	/* large files are edited in a piece table so edits never move the text */
+	if ((exists = (stat(bp->b_fname, &sb) == 0)) && PIECE_THRESHOLD <= sb.st_size)
+		bp->b_flags |= B_PIECE;
+	curbp = bp;
+	(void)insert_file(bp->b_fname, FALSE);
+	curbp = old;
+
+	/* left behind when the editor died before the file was saved */
+	if (autosave_name(bp->b_fname, aname) && stat(aname, &asb) == 0 &&
+	    (!exists || sb.st_mtime <= asb.st_mtime))
+		msg("\"%s\" has newer auto save data, c-x c-r recovers it.", bp->b_bname);
+}
 
-	if (curbp->b_point < curbp->b_mark) {
-		/* point above marker: move gap under point, region = marker - point */
-		(void)movegap(curbp, curbp->b_point);
-		p = ptr(curbp, curbp->b_point);
-		nscrap = curbp->b_mark - curbp->b_point;
-	} else {
-		/* if point below marker: move gap under marker, region = point - marker */
-		(void)movegap(curbp, curbp->b_mark);
-		p = ptr(curbp, curbp->b_mark);
-		nscrap = curbp->b_point - curbp->b_mark;
-	}
-	assert(nscrap > 0);
-	if ((scrap = (char_t*) malloc(nscrap + 1)) == NULL) {
-		msg("No more memory available.");
-	} else {
-		(void)memcpy(scrap, p, nscrap * sizeof (char_t));
-		*(scrap + nscrap) = '\0';  /* null terminate for insert_string */
-		if (cut) {
-			curbp->b_egap += nscrap; /* if cut expand gap down */
-			curbp->b_point = pos(curbp, curbp->b_egap); /* set point to after region */
-			curbp->b_flags |= B_MODIFIED;
-			if (verbose) msg("%ld bytes cut.", nscrap);
-		} else {
-			if (verbose) msg("%ld bytes copied.", nscrap);
-		}
-		curbp->b_mark = NOMARK;  /* unmark */
-	}
+/* Make a buffer current, reading its file if it has not been */
+void switch_buffer(buffer_t *bp)
+{
+	load_buffer(bp);
+	if (!(bp->b_flags & B_PIECE) && bp->b_buf == NULL && !growgap(bp, CHUNK))
+		fatal("Failed to allocate required memory.\n");
+	curbp = bp;
 }
 
-void insert_string(char *str)
+void free_buffer(buffer_t *bp)
 {
-	int len = (str == NULL) ? 0 : strlen(str);
+	ablock_t *ab, *next;
 
-	if (len <= 0) {
-		msg("nothing to insert");
-	} else if (len < curbp->b_egap - curbp->b_gap || growgap(curbp, len)) {
-		curbp->b_point = movegap(curbp, curbp->b_point);
-		memcpy(curbp->b_gap, str, len * sizeof (char_t));
-		curbp->b_gap += len;
-		curbp->b_point = pos(curbp, curbp->b_egap);
-		curbp->b_flags |= B_MODIFIED;
+	for (ab = bp->b_add; ab != NULL; ab = next) {
+		next = ab->a_next;
+		if (ab->a_mapped) munmap(ab->a_text, (size_t) ab->a_size);
+		free(ab);
 	}
+	drop_index(bp);
+	free(bp->b_wrap.w_ck);
+	uclear(&bp->b_undo);
+	uclear(&bp->b_redo);
+	free(bp->b_piece);
+	free(bp->b_buf);
+	free(bp);
 }
 
-void yank() { insert_string((char *)scrap); }
-void copy_region() { copy_cut(FALSE, TRUE); }
-void kill_region() { copy_cut(TRUE, TRUE); }
-
-/* return char at current point */
-char *get_char()
+/* Remove a buffer from the list, another becomes current if it was, FALSE if it is not in the list */
+int delete_buffer(buffer_t *bp)
 {
-	static char ch[2] = "\0\0";
-	ch[0] = (char)*(ptr(curbp, curbp->b_point));
-	return ch;
+	buffer_t **bpp;
+
+	for (bpp = &bheadp; *bpp != NULL && *bpp != bp; bpp = &(*bpp)->b_next)
+		;
+	if (*bpp == NULL) return (FALSE);
+	*bpp = bp->b_next;
+
+	if (is_bp == bp) is_bp = NULL;
+	if (autosave.as_bp == bp) autosave_reap(TRUE);
+	if (fold->f_bp == bp) fold->f_bp = NULL;
+	if (ybp == bp) ybp = NULL;
+	if (curbp == bp)
+		switch_buffer(bheadp != NULL ? bheadp : find_buffer("*scratch*", TRUE));
+	free_buffer(bp);
+	return (TRUE);
 }
 
-/* wrapper to simplify call and dependancies in the interface code */
-char *get_input_key() {	return (char *)get_key(khead, &key_return); }
-/* the name of the bound function of this key */
-char *get_key_funcname() { return (key_return != NULL ? key_return->k_funcname : ""); }
-/* the name of the last key */
-char *get_key_name() { return (key_return != NULL ? key_return->k_name : ""); }
-/* return point in current buffer */
-point_t get_point() { return curbp->b_point; }
+char *buffer_name_curbp(void) { return curbp->b_bname; }
 
-void set_point(point_t p)
+/* name of the n'th buffer in the list, NULL past the end */
+char *buffer_name_nth(int n)
 {
-	if (p < 0 || p > pos(curbp, curbp->b_ebuf)) return;
-	curbp->b_point = p;
+	buffer_t *bp;
+
+	for (bp = bheadp; bp != NULL && 0 < n; bp = bp->b_next, n--)
+		;
+	return (bp == NULL ? NULL : bp->b_bname);
 }
 
-point_t search_forward(buffer_t *bp, point_t start_p, char *stext)
-{
-	point_t end_p = pos(bp, bp->b_ebuf);
-	point_t p,pp;
-	char* s;
+void switch_to_buffer(char *bname) { switch_buffer(find_buffer(bname, TRUE)); }
+void find_file(char *fn) { switch_buffer(file_buffer(fn)); }
+void next_buffer(void) { switch_buffer(curbp->b_next != NULL ? curbp->b_next : bheadp); }
 
-	if (0 == strlen(stext)) return start_p;
+/* is the named buffer, the current one if bname is NULL, changed since it was saved */
+int buffer_modified(char *bname)
+{
+	buffer_t *bp = (bname == NULL ? curbp : find_buffer(bname, FALSE));
 
-	for (p=start_p; p < end_p; p++) {
-		for (s=stext, pp=p; *s == *(ptr(bp, pp)) && *s !='\0' && pp < end_p; s++, pp++)
-			;
-		if (*s == '\0') return pp;
-	}
-	return -1;
+	return (bp != NULL && (bp->b_flags & B_MODIFIED));
 }
 
-point_t search_forward_curbp(point_t start_p, char *stext) {
-	return search_forward(curbp, start_p, stext);
+/* kill the named buffer, the current one if bname is NULL, a modified one only if forced */
+int kill_buffer(char *bname, int force)
+{
+	buffer_t *bp = (bname == NULL ? curbp : find_buffer(bname, FALSE));
+
+	if (bp == NULL) return (FALSE);
+	if (!force && (bp->b_flags & B_MODIFIED))
+		return msg("Buffer \"%s\" is modified, not killed.", bp->b_bname);
+	return (delete_buffer(bp));
 }
 
 void user_func(void);
+extern void forget_lisp(int);
 
 keymap_t *new_key(char *name, char *bytes)
 {
@@ -650,6 +3253,7 @@ keymap_t *new_key(char *name, char *bytes)
 	kp->k_bytes[MAX_KBYTES] ='\0';
 	kp->k_func = user_func;
 	strcpy(kp->k_funcname, E_NOT_BOUND);
+	kp->k_form = -1;
 	kp->k_next = NULL;
 	return kp;
 }
@@ -660,6 +3264,7 @@ void make_key(char *name, char *bytes)
 	keymap_t *kp = new_key(name, bytes);
 	ktail->k_next = kp;
 	ktail = kp;
+	key_insert(&ktrie, kp);
 }
 
 void create_keys()
@@ -674,6 +3279,7 @@ void create_keys()
 
 	assert(khead == NULL);
 	khead = ktail = new_key("c-space", "\x00");
+	key_insert(&ktrie, khead);
 
 	/* control-a to z */
 	for (ch = 1; ch <= 26; ch++) {
@@ -698,16 +3304,20 @@ void create_keys()
 	}
 
 	make_key("c-x ?", "\x18\x3F");
+	make_key("c-x b", "\x18\x62");
+	make_key("c-x k", "\x18\x6B");
 }
 
 int set_key_internal(char *name, char *funcname, char *bytes, void (*func)(void))
 {
 	keymap_t *kp;
 	
-	for (kp = khead; kp->k_next != NULL; kp = kp->k_next) {
+	for (kp = khead; kp != NULL; kp = kp->k_next) {
 		if (0 == strcmp(kp->k_name, name)) {
 			strncpy(kp->k_funcname, funcname, MAX_KFUNC);
 			kp->k_funcname[MAX_KFUNC] ='\0';
+			forget_lisp(kp->k_form);
+			kp->k_form = -1;
 			if (func != NULL)  /* dont set if its a user_func */
 				kp->k_func = func;
 			return 1;
@@ -722,6 +3332,7 @@ int set_key_internal(char *name, char *funcname, char *bytes, void (*func)(void)
 		kp->k_func = func;
 		ktail->k_next = kp;
 		ktail = kp;
+		key_insert(&ktrie, kp);
 		return 1;
 	}
 	return 0;
@@ -732,8 +3343,61 @@ int set_key(char *name, char *funcname)
 	return set_key_internal(name, funcname, "", NULL);
 }
 
+keymode_t *find_mode(char *mname, int cflag)
+{
+	keymode_t *mp;
+
+	for (mp = kmodes; mp != NULL; mp = mp->km_next)
+		if (0 == strcmp(mp->km_name, mname))
+			return (mp);
+	if (!cflag || (mp = (keymode_t *)calloc(1, sizeof(keymode_t))) == NULL)
+		return (NULL);
+	strncpy(mp->km_name, mname, MAX_KNAME);
+	mp->km_name[MAX_KNAME] = '\0';
+	mp->km_next = kmodes;
+	kmodes = mp;
+	return (mp);
+}
+
+/* bind a global key name to funcname in the named mode only */
+int set_mode_key(char *mname, char *name, char *funcname)
+{
+	keymode_t *mp;
+	keymap_t *kp, *gp;
+
+	for (gp = khead; gp != NULL && 0 != strcmp(gp->k_name, name); gp = gp->k_next)
+		;
+	if (gp == NULL || (mp = find_mode(mname, TRUE)) == NULL)
+		return 0;
+	for (kp = mp->km_keys; kp != NULL && 0 != strcmp(kp->k_name, name); kp = kp->k_next)
+		;
+	if (kp == NULL) {
+		kp = new_key(name, gp->k_bytes);
+		kp->k_next = mp->km_keys;
+		mp->km_keys = kp;
+		key_insert(&mp->km_trie, kp);
+	}
+	strncpy(kp->k_funcname, funcname, MAX_KFUNC);
+	kp->k_funcname[MAX_KFUNC] ='\0';
+	forget_lisp(kp->k_form);
+	kp->k_form = -1;
+	return 1;
+}
+
+/* give the current buffer the keys of the named mode, "" for none */
+int set_mode(char *mname)
+{
+	if (curbp == NULL) return 0;
+	curbp->b_mode = (*mname == '\0' ? NULL : find_mode(mname, TRUE));
+	return (*mname == '\0' || curbp->b_mode != NULL);
+}
+
+char *get_mode() { return (curbp != NULL && curbp->b_mode != NULL ? curbp->b_mode->km_name : ""); }
+
 extern char *load_file(int);
 extern char *call_lisp(char *);
+extern int compile_lisp(char *);
+extern char *run_lisp(int);
 extern void init_lisp(void);
 extern void reset_output_stream();
 
@@ -746,19 +3410,24 @@ void eval_block()
 		return;
 	}
 
-	copy_cut(FALSE, FALSE);
-	assert(scrap != NULL);
-	assert(strlen(scrap) > 0);
+	/* copy_cut() has said why when it could not copy the block */
+	if (!copy_cut(FALSE, FALSE)) return;
 
 	reset_output_stream();
-	output = call_lisp((char *)scrap);
+	output = call_lisp((char *)kring[knew]);
 	insert_string("\n");
 	insert_string(output);
 	reset_output_stream();
 }
 
+/*
+ * The binding is read the first time the key is used and kept, so after
+ * that a key press only evaluates it.  A binding that cannot be read goes
+ * through call_lisp() each time, which reports why.
+ */
 void user_func()
 {
+	keymap_t *kp = key_return;
 	char *output;
 	assert(key_return != NULL);
 	if (0 == strcmp(key_return->k_funcname, E_NOT_BOUND)) {
@@ -767,10 +3436,18 @@ void user_func()
 	}
 
 	reset_output_stream();
-	output = call_lisp(key_return->k_funcname);
+	if (kp->k_form < 0)
+		kp->k_form = compile_lisp(kp->k_funcname);
+	if (kp->k_form < 0) {
+		output = call_lisp(kp->k_funcname);
+		if (NULL == strstr(output, "error:"))
+			output = NULL;
+	} else {
+		output = run_lisp(kp->k_form);
+	}
 
 	/* show errors on message line */
-	if (NULL != strstr(output, "error:")) {
+	if (NULL != output) {
 		char buf[81];
 		strncpy(buf, output, 80);
 		buf[80] ='\0';
@@ -779,6 +3456,131 @@ void user_func()
 	reset_output_stream();
 }
 
+/* run the command bound to a key, or insert the key */
+void execute_key(keymap_t *kp, char_t *s)
+{
+	key_return = kp;
+	input = s;
+	placed = FALSE;
+	if (kp != NULL) {
+		(kp->k_func)();
+	} else {
+		/* allow TAB and NEWLINE, any other control char is 'Not Bound' */
+		if (*s > 31 || *s == 10 || *s == 9)
+			insert_run();
+		else {
+			fflush(stdin);
+			msg(E_NOT_BOUND);
+		}
+	}
+}
+
+void start_macro()
+{
+	if (kdefining || kplay != NULL) {
+		msg("Already defining or running a keyboard macro");
+		return;
+	}
+	kdefining = TRUE;
+	kmlen = 0;
+	msg("Defining keyboard macro...");
+}
+
+void end_macro()
+{
+	if (!kdefining) {
+		msg("Not defining keyboard macro");
+		return;
+	}
+	/* leaving out the key that ended it */
+	kdefining = FALSE;
+	kmlen = kmstart;
+	msg("Keyboard macro defined");
+}
+
+/* replay the keys of the macro, painting nothing until they are all done */
+void call_macro()
+{
+	keymap_t *kp;
+	char_t *s;
+
+	if (kdefining || kplay != NULL || kmlen == 0) {
+		msg(kmlen == 0 ? "No keyboard macro defined" : "Can't run a keyboard macro from within one");
+		return;
+	}
+	hold_display++;
+	kplay = kmacro;
+	kpend = kmacro + kmlen;
+	/* insert_run() may have read the last key ahead and put it back */
+	while (kback != -1 || (kplay != NULL && kplay < kpend)) {
+		s = get_key(curbp, &kp);
+		execute_key(kp, s);
+	}
+	kplay = NULL;
+	hold_display--;
+}
+
+/* set the keyboard macro to the bytes of a string */
+void set_macro(char *s)
+{
+	int n = (int) strlen(s);
+	char_t *p;
+
+	if (kdefining || kplay != NULL) return;
+	if (kmmax < n) {
+		if ((p = (char_t *) realloc(kmacro, n)) == NULL) return;
+		kmacro = p;
+		kmmax = n;
+	}
+	memcpy(kmacro, s, n);
+	kmlen = n;
+}
+
+/*
+ * C-u, then digits for a count or more C-u to multiply it by 4, runs the
+ * next key that many times, painting nothing until the last has run.
+ */
+void universal_argument()
+{
+	keymap_t *kp;
+	char_t *s, ch[2];
+	long n = 4, k;
+	int digits = FALSE;
+
+	for (;;) {
+		msg("C-u %ld-", n);
+		display();
+		s = get_key(curbp, &kp);
+		if (kp == NULL && '0' <= *s && *s <= '9') {
+			n = (digits ? n * 10 : 0) + *s - '0';
+			digits = TRUE;
+		} else if (kp != NULL && kp->k_func == universal_argument && !digits) {
+			n *= 4;
+		} else {
+			break;
+		}
+	}
+	msgflag = FALSE;
+	/* the key may read keys of its own, so keep a copy of it */
+	ch[0] = *s;
+	ch[1] = '\0';
+	hold_display++;
+	if (kp == NULL && (31 < *ch || *ch == 10 || *ch == 9)) {
+		/* a typed char is inserted n times over in a few inserts, reading nothing ahead */
+		memset(temp, *ch, TEMPBUF);
+		for (; 0 < n; n -= k) {
+			k = (n < TEMPBUF ? n : TEMPBUF);
+			if (!insert_text(curbp, curbp->b_point, (char_t *) temp, k)) break;
+			curbp->b_point += k;
+			curbp->b_flags |= B_MODIFIED;
+		}
+	} else {
+		while (0 < n--)
+			execute_key(kp, kp == NULL ? ch : s);
+	}
+	hold_display--;
+}
+
 void load_config()
 {
 	char fname[300];
@@ -788,8 +3590,10 @@ void load_config()
 	reset_output_stream();
 	(void)snprintf(fname, 300, "%s/%s", getenv("HOME"), E_INITFILE);
 
-	if ((fd = open(fname, O_RDONLY)) == -1)
+	if ((fd = open(fname, O_RDONLY)) == -1) {
+		if (batch) return;
 		fatal("failed to open " E_INITFILE " in HOME directory");
+	}
 
 	reset_output_stream();
 	output = load_file(fd);
@@ -816,6 +3620,9 @@ void setup_keys()
 	set_key_internal("c-v",     "(page-down)",           "\x16", pgdown);
 	set_key_internal("c-w",     "(kill-region)",         "\x17", kill_region);
 	set_key_internal("c-y",     "(yank)",                "\x19", yank);
+	set_key_internal("c-l",     "(redraw)",              "\x0C", redraw);
+	set_key_internal("c-_",     "(undo)",                "\x1F", undo);
+	set_key_internal("esc-y",   "(yank-pop)",            "\x1B\x79", yank_pop);
 	set_key_internal("esc-k",   "(kill-region)",         "\x1B\x6B", kill_region);
 	set_key_internal("esc-v",   "(page-up)",             "\x1B\x76", pgup);
 	set_key_internal("esc-w",   "(copy-region)",         "\x1B\x77", copy_region);
@@ -834,48 +3641,212 @@ void setup_keys()
 	set_key_internal("backspace","(backspace)",          "\x7f", backspace);
 	set_key_internal("c-x c-s", "(save-buffer)",         "\x18\x13", save_buffer);  
 	set_key_internal("c-x c-c", "(exit)",                "\x18\x03", quit);
+	set_key_internal("c-x c-r", "(recover-file)",        "\x18\x12", recover_file);
+	set_key_internal("c-x u",   "(undo)",                "\x18\x75", undo);
+	set_key_internal("c-x r",   "(redo)",                "\x18\x72", redo);
+	set_key_internal("c-x (",   "(start-kbd-macro)",     "\x18\x28", start_macro);
+	set_key_internal("c-x )",   "(end-kbd-macro)",       "\x18\x29", end_macro);
+	set_key_internal("c-x e",   "(call-last-kbd-macro)", "\x18\x65", call_macro);
+	set_key_internal("c-u",     "(universal-argument)",  "\x15", universal_argument);
+	set_key_internal("paste",   "(paste)",               "\x1B[200~", paste);
 	set_key_internal("c-space", "(set-mark)",            "\x00", set_mark);
 	set_key_internal("c-]",     E_NOT_BOUND,             "\x1D", user_func);
 	set_key_internal("resize",  "(resize)",              "\x9A", resize_terminal);
 }
 
+/*
+ * zepl --batch script.lsp file...  runs the script in each file's buffer in
+ * turn and saves the buffer if it changed, with no terminal.  Messages go
+ * to stderr.  Returns 1 if the script failed in any of them or one could
+ * not be saved, which are then left as they were.  Each file's buffer is
+ * deleted once it is done with, so only one file is held at a time.
+ */
+int run_batch(char *script, int nfile, char **files)
+{
+	buffer_t *bp, *p;
+	char *output, *err;
+	int i, fd, status = 0;
+
+	for (i = 0; i < nfile || i == 0; i++) {
+		bp = (nfile == 0 ? find_buffer("*scratch*", TRUE) : file_buffer(files[i]));
+		switch_buffer(bp);
+		if ((fd = open(script, O_RDONLY)) == -1) {
+			fprintf(stderr, "%s: cannot open %s: %s\n", E_NAME, script, strerror(errno));
+			return (2);
+		}
+		reset_output_stream();
+		output = load_file(fd);
+		close(fd);
+
+		/* the script may have killed the buffer, or left another current */
+		for (p = bheadp; p != NULL && p != bp; p = p->b_next)
+			;
+		if (output != NULL && (err = strstr(output, "error:")) != NULL) {
+			fprintf(stderr, "%s: %s", (nfile == 0 ? script : files[i]), err);
+			status = 1;
+		} else if (p != NULL && (bp->b_flags & B_MODIFIED) && bp->b_fname[0] != '\0') {
+			curbp = bp;
+			save_buffer();
+			if (bp->b_flags & B_MODIFIED) status = 1;
+		}
+		reset_output_stream();
+		/* done with the file, so free its text or unmap it before the next */
+		if (p != NULL && nfile != 0) (void)delete_buffer(bp);
+	}
+	return (status);
+}
+
+/* add a command's run time to the replay's figures for it */
+void cmd_note(char *name, long us)
+{
+	cmdstat_t *cs;
+
+	for (cs = cstat; cs < cstat + ncstat && strcmp(cs->cs_name, name) != 0; cs++)
+		;
+	if (cs == cstat + ncstat) {
+		if (ncstat == TRACE_CMDS) {
+			cs_lost++;
+			cs_lost_us += us;
+			return;
+		}
+		strcpy(cs->cs_name, name);
+		cs->cs_count = cs->cs_total = cs->cs_max = 0;
+		ncstat++;
+	}
+	cs->cs_count++;
+	cs->cs_total += us;
+	if (cs->cs_max < us) cs->cs_max = us;
+}
+
+/* s as the inside of a JSON string, out needs room for 6 chars per char of s */
+char *json_escape(char *s, char *out)
+{
+	char *d = out;
+
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\') {
+			*d++ = '\\';
+			*d++ = *s;
+		} else if ((unsigned char) *s < 32) {
+			d += sprintf(d, "\\u%04x", (unsigned char) *s);
+		} else {
+			*d++ = *s;
+		}
+	}
+	*d = '\0';
+	return (out);
+}
+
+/* the timings of a replay on stderr, as a line of JSON for the whole and one for each command */
+void replay_report()
+{
+	cmdstat_t *cs;
+	char name[6 * MAX_KFUNC + 1];
+	long run = cs_lost_us;
+
+	for (cs = cstat; cs < cstat + ncstat; cs++)
+		run += cs->cs_total;
+	fprintf(stderr, "{\"replay\":\"total\",\"keys\":%ld,\"secs\":%.6f,\"run_secs\":%.6f,\"paint_secs\":%.6f,"
+		"\"unlisted\":%ld,\"unlisted_us\":%ld}\n",
+		ktrace.t_keys, us_since(&ktrace.t_start) / 1e6, run / 1e6, ktrace.t_paint / 1e6, cs_lost, cs_lost_us);
+	for (cs = cstat; cs < cstat + ncstat; cs++)
+		fprintf(stderr, "{\"replay\":\"%s\",\"count\":%ld,\"total_us\":%ld,\"mean_us\":%ld,\"max_us\":%ld}\n",
+			json_escape(cs->cs_name, name), cs->cs_count, cs->cs_total, cs->cs_total / cs->cs_count, cs->cs_max);
+}
+
+/* --record file, --replay file and --fast, returning the index of the first file name */
+int trace_options(int argc, char **argv)
+{
+	char head[32];
+	int i;
+
+	for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+		if (strcmp(argv[i], "--fast") == 0) {
+			ktrace.t_fast = TRUE;
+		} else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			if ((ktrace.t_out = fopen(argv[++i], "w")) == NULL)
+				fatal("failed to open the trace to record");
+			/* a line at a time, so a crash keeps the keys that led to it */
+			setvbuf(ktrace.t_out, NULL, _IOLBF, 0);
+			fprintf(ktrace.t_out, "zepl-trace 1\n");
+		} else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			if ((ktrace.t_in = fopen(argv[++i], "r")) == NULL)
+				fatal("failed to open the trace to replay");
+			if (fgets(head, sizeof (head), ktrace.t_in) == NULL || strcmp(head, "zepl-trace 1\n") != 0)
+				fatal("not a zepl trace");
+		} else {
+			fatal("usage: zepl [--record trace | --replay trace [--fast]] [file...]");
+		}
+	}
+	return (i);
+}
+
 int main(int argc, char **argv)
 {
-	if (argc != 2) fatal("usage: " E_NAME " filename\n");
+	struct timespec t0, t1, t2, t3;
+	char name[MAX_KFUNC + 1];
+	int i;
 
 	setup_keys();
 	(void)init_lisp();
+	if (3 <= argc && strcmp(argv[1], "--batch") == 0) {
+		/* nothing is painted, and rows move as on an 80 by 24 terminal */
+		batch = TRUE;
+		hold_display = 1;
+		LINES = 24;
+		COLS = 80;
+		load_config();
+		return (run_batch(argv[2], argc - 3, argv + 3));
+	}
+	i = trace_options(argc, argv);
 	load_config();
 	initscr();	
 	raw();
 	noecho();
+	/* have the terminal mark pasted text, see paste() */
+	putp("\x1B[?2004h");
+	fflush(stdout);
 	
-	curbp = new_buffer();
-	(void)insert_file(argv[1], FALSE);
-	/* Save filename irregardless of load() success. */
-	strncpy(curbp->b_fname, argv[1], MAX_FNAME);
-	curbp->b_fname[MAX_FNAME] = '\0'; /* force truncation */
-
-	if (!growgap(curbp, CHUNK)) fatal("Failed to allocate required memory.\n");
+	/* files are only read when their buffer is first shown */
+	for (; i < argc; i++)
+		(void)file_buffer(argv[i]);
+	switch_buffer(bheadp != NULL ? bheadp : find_buffer("*scratch*", TRUE));
+	as_time = time(NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ktrace.t_start);
 
 	while (!done) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
 		display();
-		input = get_key(khead, &key_return);
-
-		if (key_return != NULL) {
-			(key_return->k_func)();
-		} else {
-			/* allow TAB and NEWLINE, any other control char is 'Not Bound' */
-			if (*input > 31 || *input == 10 || *input == 9)
-				insert();
-                        else {
-				fflush(stdin);
-				msg(E_NOT_BOUND);
-			}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		input = get_key(curbp, &key_return);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		undo_seq++;
+		/* a command that reads keys of its own changes key_return */
+		strcpy(name, key_return != NULL ? key_return->k_funcname : "(self-insert)");
+
+		execute_key(key_return, input);
+		clock_gettime(CLOCK_MONOTONIC, &t3);
+		(void)lat_note(LAT_PAINT, &t0, &t1);
+		(void)lat_note(LAT_READ, &t1, &t2);
+		if (lat_slowest < lat_note(LAT_RUN, &t2, &t3)) {
+			lat_slowest = lat_last[LAT_RUN];
+			strcpy(lat_slowfn, name);
+		}
+		if (ktrace.t_in != NULL) {
+			ktrace.t_keys++;
+			ktrace.t_paint += lat_last[LAT_PAINT];
+			cmd_note(name, lat_last[LAT_RUN]);
 		}
+		/* after the timings, so a snapshot is not charged to the key */
+		autosave_check();
 	}
+	autosave_reap(TRUE);
 
+	putp("\x1B[?2004l");
+	fflush(stdout);
 	noraw();
 	endwin();
+	if (ktrace.t_out != NULL) fclose(ktrace.t_out);
+	if (ktrace.t_in != NULL) replay_report();
 	return 0;
 }